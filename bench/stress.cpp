@@ -0,0 +1,225 @@
+/*
+Stress and crash-recover harness.
+Worker threads run a random mix of enqueues and dequeues on one queue, then all stop at once, which stands for
+a crash at an operation boundary: each worker drops the volatile state of its allocators, and worker 0 recovers
+the queue. After the last round the queue is drained. Every enqueued item must have been dequeued exactly once,
+and each consumer must have dequeued the items of each producer in the order they were enqueued.
+Recovery scans worker 0's alloc only, so for the queues that find their nodes by scanning (UnlinkedQ, OptUnlinkedQ)
+worker 0 is the only enqueuer.
+
+Usage: stress [<queue> [<threads> [<rounds> [<operations per thread and round>]]]]
+with <queue> one of linked, unlinked, optlinked, optunlinked, segmented, timestamped, or all (the default),
+which tests each queue in a process of its own, as ssmem keeps its allocators for the life of the process.
+*/
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <random>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <ssmem.h>
+
+__thread ssmem_allocator_t* alloc;
+__thread ssmem_allocator_t* volatileAlloc;
+
+#include "LinkedQ.h"
+#include "UnlinkedQ.h"
+#include "OptLinkedQ.h"
+#include "OptUnlinkedQ.h"
+#include "SegmentedQ.h"
+#include "TimestampedQ.h"
+
+#define PRODUCER_SHIFT 40 /* an item is its producer's id above this bit, and its sequence number below */
+
+static void initAllocators(int threadId) {
+    alloc = (ssmem_allocator_t*)malloc(sizeof(ssmem_allocator_t));
+    ssmem_alloc_init(alloc, SSMEM_DEFAULT_MEM_SIZE, threadId);
+    volatileAlloc = (ssmem_allocator_t*)malloc(sizeof(ssmem_allocator_t));
+    ssmem_alloc_init(volatileAlloc, SSMEM_DEFAULT_MEM_SIZE, threadId);
+}
+
+// A crash loses the allocator's free lists, which are volatile, while its chunks survive
+static void dropFreeLists(ssmem_allocator_t* a) {
+    a->free_set_list->curr = 0;
+    a->free_set_list->ts_set = nullptr;
+    a->free_set_list->set_next = nullptr;
+    a->free_set_num = 1;
+    a->collected_set_list = nullptr;
+    a->collected_set_num = 0;
+    a->available_set_list = nullptr;
+    a->released_mem_list = nullptr;
+    a->released_num = 0;
+}
+
+// The nodes volatileAlloc has handed out are lost too, and recovery allocates new ones
+static void crashAllocators() {
+    dropFreeLists(alloc);
+    dropFreeLists(volatileAlloc);
+}
+
+class Barrier {
+public:
+    Barrier(int n) :
+        numThreads(n),
+        arrived(0),
+        round(0)
+    {}
+
+    void await() {
+        int myRound = round.load();
+        if (arrived.fetch_add(1) + 1 == numThreads) {
+            arrived.store(0);
+            round.fetch_add(1);
+            return;
+        }
+        while (round.load() == myRound) {
+            std::this_thread::yield();
+        }
+    }
+
+private:
+    int numThreads;
+    std::atomic<int> arrived;
+    std::atomic<int> round;
+};
+
+template<class Q> void recoverQueue(Q* queue) {
+    queue->recover();
+}
+
+template<> void recoverQueue(SegmentedQ<uint64_t>* queue) {
+    if (!queue->recover()) {
+        fprintf(stderr, "SegmentedQ recovery failed\n");
+        exit(1);
+    }
+}
+
+template<class Q> bool stress(const char* name, bool allEnqueue, int numThreads, int numRounds, int numOps) {
+    std::atomic<Q*> queue(nullptr);
+    std::vector<uint64_t> enqueued(numThreads, 0);
+    std::vector<std::vector<uint64_t>> dequeued(numThreads);
+    Barrier barrier(numThreads);
+
+    auto worker = [&](int threadId) {
+        initAllocators(threadId);
+        barrier.await(); // Every thread registers with ssmem before any frees
+        if (threadId == 0) {
+            queue.store(new Q());
+        }
+        barrier.await();
+        Q* q = queue.load();
+
+        std::mt19937_64 random(threadId * 7919 + 1);
+        bool isProducer = allEnqueue || threadId == 0;
+        for (int round = 0; round < numRounds; round++) {
+            int ops = numOps / 2 + random() % numOps; // The workers stop at different points
+            for (int i = 0; i < ops; i++) {
+                if (isProducer && random() % 2 == 0) {
+                    q->enq(((uint64_t)threadId << PRODUCER_SHIFT) | ++enqueued[threadId], threadId);
+                } else {
+                    uint64_t item;
+                    if (q->deq(&item, threadId)) {
+                        dequeued[threadId].push_back(item);
+                    }
+                }
+            }
+
+            barrier.await(); // The crash
+            crashAllocators();
+            barrier.await();
+            if (threadId == 0) {
+                recoverQueue(q);
+            }
+            barrier.await();
+        }
+
+        if (threadId == 0) {
+            uint64_t item;
+            while (q->deq(&item, 0)) {
+                dequeued[0].push_back(item);
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < numThreads; i++) {
+        workers.push_back(std::thread(worker, i));
+    }
+    worker(0);
+    for (auto& w : workers) {
+        w.join();
+    }
+
+    uint64_t total = 0;
+    uint64_t errors = 0;
+    std::vector<std::vector<uint8_t>> seen(numThreads);
+    for (int p = 0; p < numThreads; p++) {
+        seen[p].assign(enqueued[p] + 1, 0);
+        total += enqueued[p];
+    }
+    for (int c = 0; c < numThreads; c++) {
+        std::vector<uint64_t> lastOf(numThreads, 0);
+        for (uint64_t item : dequeued[c]) {
+            uint64_t producer = item >> PRODUCER_SHIFT;
+            uint64_t sequence = item & ((1ull << PRODUCER_SHIFT) - 1);
+            if (producer >= (uint64_t)numThreads || sequence == 0 || sequence > enqueued[producer] ||
+                seen[producer][sequence]++ != 0 || sequence <= lastOf[producer]) {
+                errors++; // Unknown, duplicated or out of order
+            }
+            lastOf[producer] = sequence;
+        }
+    }
+    for (int p = 0; p < numThreads; p++) {
+        for (uint64_t s = 1; s <= enqueued[p]; s++) {
+            errors += seen[p][s] == 0; // Lost
+        }
+    }
+
+    printf("%-12s %s: %lu items, %d crashes, %lu errors\n", name, errors ? "FAIL" : "ok",
+           (unsigned long)total, numRounds, (unsigned long)errors);
+    return errors == 0;
+}
+
+template<class Q> bool runStress(const std::string& queue, const char* key, const char* name, bool allEnqueue,
+                                 int numThreads, int numRounds, int numOps) {
+    if (queue == key) {
+        return stress<Q>(name, allEnqueue, numThreads, numRounds, numOps);
+    }
+    if (queue != "all") {
+        return true;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        exit(stress<Q>(name, allEnqueue, numThreads, numRounds, numOps) ? 0 : 1);
+    }
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        if (pid < 0 || !WIFEXITED(status)) {
+            printf("%-12s FAIL: did not complete\n", name);
+        }
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    std::string queue = argc > 1 ? argv[1] : "all";
+    int numThreads = argc > 2 ? atoi(argv[2]) : 4;
+    int numRounds = argc > 3 ? atoi(argv[3]) : 20;
+    int numOps = argc > 4 ? atoi(argv[4]) : 20000;
+
+    bool ok = true;
+    ok &= runStress<LinkedQ<uint64_t>>(queue, "linked", "LinkedQ", true, numThreads, numRounds, numOps);
+    ok &= runStress<UnlinkedQ<uint64_t>>(queue, "unlinked", "UnlinkedQ", false, numThreads, numRounds, numOps);
+    ok &= runStress<OptLinkedQ<uint64_t>>(queue, "optlinked", "OptLinkedQ", true, numThreads, numRounds, numOps);
+    ok &= runStress<OptUnlinkedQ<uint64_t>>(queue, "optunlinked", "OptUnlinkedQ", false, numThreads, numRounds, numOps);
+    ok &= runStress<SegmentedQ<uint64_t>>(queue, "segmented", "SegmentedQ", true, numThreads, numRounds, numOps);
+    ok &= runStress<TimestampedQ<uint64_t>>(queue, "timestamped", "TimestampedQ", true, numThreads, numRounds, numOps);
+    return ok ? 0 : 1;
+}
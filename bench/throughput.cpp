@@ -0,0 +1,95 @@
+/*
+Throughput driver: each thread runs enqueue-dequeue pairs on a shared queue, and the driver prints the
+operations per second of each queue. Build it with both WEAK_MEMORY_ORDERS profiles to compare them (see Makefile).
+
+Usage: throughput [<threads> [<pairs per thread>]]
+*/
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <ssmem.h>
+
+__thread ssmem_allocator_t* alloc;
+__thread ssmem_allocator_t* volatileAlloc;
+
+#include "LinkedQ.h"
+#include "UnlinkedQ.h"
+#include "OptLinkedQ.h"
+#include "OptUnlinkedQ.h"
+#include "SegmentedQ.h"
+#include "TimestampedQ.h"
+#include "CohortQ.h"
+
+static void initAllocators(int threadId) {
+    alloc = (ssmem_allocator_t*)malloc(sizeof(ssmem_allocator_t));
+    ssmem_alloc_init(alloc, SSMEM_DEFAULT_MEM_SIZE, threadId);
+    volatileAlloc = (ssmem_allocator_t*)malloc(sizeof(ssmem_allocator_t));
+    ssmem_alloc_init(volatileAlloc, SSMEM_DEFAULT_MEM_SIZE, threadId);
+}
+
+template<class Q> Q* newQueue() {
+    return new Q();
+}
+
+template<> CohortQ<uint64_t>* newQueue() {
+    return new CohortQ<uint64_t>(2);
+}
+
+template<class Q> void measure(const char* name, int numThreads, int numPairs) {
+    std::atomic<Q*> queue(nullptr);
+    std::atomic<int> registered(0);
+    std::atomic<bool> start(false);
+
+    auto worker = [&](int threadId) {
+        initAllocators(threadId);
+        registered.fetch_add(1); // Every thread registers with ssmem before any frees
+        while (!start.load()) {
+            std::this_thread::yield();
+        }
+        Q* q = queue.load();
+        uint64_t item;
+        for (int i = 0; i < numPairs; i++) {
+            q->enq(i, threadId);
+            q->deq(&item, threadId);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < numThreads; i++) {
+        workers.push_back(std::thread(worker, i));
+    }
+    while (registered.load() < numThreads) {
+        std::this_thread::yield();
+    }
+    // The queue's own allocations come from a thread id none of the workers uses
+    initAllocators(numThreads);
+    queue.store(newQueue<Q>());
+
+    auto begin = std::chrono::steady_clock::now();
+    start.store(true);
+    for (auto& w : workers) {
+        w.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    printf("%-12s %d threads: %.2f Mops/s\n", name, numThreads, 2.0 * numPairs * numThreads / seconds / 1e6);
+}
+
+int main(int argc, char** argv) {
+    int numThreads = argc > 1 ? atoi(argv[1]) : 4;
+    int numPairs = argc > 2 ? atoi(argv[2]) : 500000;
+
+    printf("WEAK_MEMORY_ORDERS=%d\n", WEAK_MEMORY_ORDERS);
+    measure<LinkedQ<uint64_t>>("LinkedQ", numThreads, numPairs);
+    measure<UnlinkedQ<uint64_t>>("UnlinkedQ", numThreads, numPairs);
+    measure<OptLinkedQ<uint64_t>>("OptLinkedQ", numThreads, numPairs);
+    measure<OptUnlinkedQ<uint64_t>>("OptUnlinkedQ", numThreads, numPairs);
+    measure<SegmentedQ<uint64_t>>("SegmentedQ", numThreads, numPairs);
+    measure<TimestampedQ<uint64_t>>("TimestampedQ", numThreads, numPairs);
+    measure<CohortQ<uint64_t>>("CohortQ", numThreads, numPairs);
+    return 0;
+}
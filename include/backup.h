@@ -0,0 +1,128 @@
+#pragma once
+
+#ifndef BACKUP_H_
+#define BACKUP_H_
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <type_traits>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define BACKUP_MAGIC          0x51424b42 /* marks a backup file whose header was written last, once it was complete */
+#define BACKUP_BUFFER_RECORDS 4096       /* records gathered before they are written to the backup file */
+
+/*
+A backup file holds a header, with the head index of the queue when it was taken and the largest index it covers,
+followed by the records of the items with an index above the one the previous backup of the chain covered.
+A chain starts with a full backup (lastIndex 0), and its items are those of all its files
+with an index above the head index of the last one.
+*/
+template<class T> struct BackupRecord {
+    uint64_t index;
+    uint64_t expiresAt; // 0 if the item never expires
+    T item;
+};
+
+struct BackupHeader {
+    uint32_t magic;
+    uint32_t itemSize;
+    uint64_t headIndex;
+    uint64_t lastIndex;
+    uint64_t numRecords;
+};
+
+template<class T> class BackupWriter {
+    static_assert(std::is_trivially_copyable<T>::value, "backed-up items are written as they are in memory");
+
+public:
+    BackupWriter() :
+        file(nullptr),
+        numRecords(0),
+        failed(false)
+    {}
+
+    ~BackupWriter() {
+        if (file) {
+            fclose(file);
+        }
+    }
+
+    // The header is left invalid until close, so that a backup cut short is never restored
+    bool open(const char* path) {
+        file = fopen(path, "wb");
+        BackupHeader header = {0, 0, 0, 0, 0};
+        failed = (file == nullptr) || fwrite(&header, sizeof(header), 1, file) != 1;
+        buffer.reserve(BACKUP_BUFFER_RECORDS);
+        return !failed;
+    }
+
+    void add(uint64_t index, uint64_t expiresAt, const T& item) {
+        buffer.push_back(BackupRecord<T>{index, expiresAt, item});
+        if (buffer.size() == BACKUP_BUFFER_RECORDS) {
+            writeBuffer();
+        }
+    }
+
+    // Returns whether the whole backup reached the file system's storage
+    bool close(uint64_t headIndex, uint64_t lastIndex) {
+        writeBuffer();
+        BackupHeader header = {BACKUP_MAGIC, sizeof(T), headIndex, lastIndex, numRecords};
+        failed = failed || fflush(file) != 0 || fsync(fileno(file)) != 0 || fseek(file, 0, SEEK_SET) != 0 ||
+            fwrite(&header, sizeof(header), 1, file) != 1 || fflush(file) != 0 || fsync(fileno(file)) != 0;
+        failed = (fclose(file) != 0) || failed;
+        file = nullptr;
+        return !failed;
+    }
+
+private:
+    FILE* file;
+    std::vector<BackupRecord<T>> buffer;
+    uint64_t numRecords;
+    bool failed;
+
+    void writeBuffer() {
+        if (!failed && !buffer.empty()) {
+            failed = fwrite(buffer.data(), sizeof(BackupRecord<T>), buffer.size(), file) != buffer.size();
+        }
+        numRecords += buffer.size();
+        buffer.clear();
+    }
+};
+
+// The items of a backup chain, in index order. Returns false, with no records, if a file is missing or incomplete.
+template<class T> bool readBackupChain(const std::vector<std::string>& paths, std::vector<BackupRecord<T>>& records) {
+    uint64_t headIndex = 0;
+    records.clear();
+    for (const std::string& path : paths) {
+        FILE* file = fopen(path.c_str(), "rb");
+        if (file == nullptr) {
+            records.clear();
+            return false;
+        }
+        BackupHeader header;
+        bool isValid = fread(&header, sizeof(header), 1, file) == 1 &&
+            header.magic == BACKUP_MAGIC && header.itemSize == sizeof(T);
+        if (isValid) {
+            size_t numRecords = records.size();
+            records.resize(numRecords + header.numRecords);
+            isValid = fread(records.data() + numRecords, sizeof(BackupRecord<T>), header.numRecords, file) == header.numRecords;
+            headIndex = header.headIndex;
+        }
+        fclose(file);
+        if (!isValid) {
+            records.clear();
+            return false;
+        }
+    }
+
+    records.erase(std::remove_if(records.begin(), records.end(),
+        [headIndex](const BackupRecord<T>& record) { return record.index <= headIndex; }), records.end());
+    std::stable_sort(records.begin(), records.end(),
+        [](const BackupRecord<T>& record1, const BackupRecord<T>& record2) { return record1.index < record2.index; });
+    return true;
+}
+
+#endif /* BACKUP_H_ */
@@ -0,0 +1,81 @@
+#pragma once
+
+#ifndef CAPACITY_H_
+#define CAPACITY_H_
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "utilities.h"
+
+#define CAPACITY_WAIT_INTERVAL_US 1000 /* how often a waiting enqueue re-checks the bounds without being woken */
+
+/*
+Optional bounds of a queue, enforced by its tryEnq and enqWait (enq ignores them):
+at most maxItems items, and at most maxNodeBytes bytes of nodes holding items.
+The memory bound counts the queue's live nodes, not the allocators' chunks, which never shrink,
+so every dequeue makes room whichever thread enqueued or dequeued.
+The bounds are checked before enqueuing, so concurrent enqueuers may exceed them by up to their number of nodes.
+*/
+class Capacity {
+public:
+    Capacity() :
+        maxItems(0),
+        maxNodeBytes(0),
+        waiters(0)
+    {}
+
+    // 0 for unbounded; set before the queue is used concurrently
+    void set(uint64_t items, size_t nodeBytes) {
+        maxItems = items;
+        maxNodeBytes = nodeBytes;
+    }
+
+    bool isBounded() const {
+        return maxItems != 0 || maxNodeBytes != 0;
+    }
+
+    // Whether one more node of nodeSize bytes can be added to a queue of size items
+    bool hasRoom(uint64_t size, size_t nodeSize) const {
+        if (maxItems != 0 && size >= maxItems) {
+            return false;
+        }
+        if (maxNodeBytes != 0 && (size + 1) * nodeSize > maxNodeBytes) {
+            return false;
+        }
+        return true;
+    }
+
+    template<class F> void waitForRoom(F hasRoomNow) {
+        if (hasRoomNow()) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(waitLock);
+        waiters++;
+        while (!hasRoomNow()) {
+            dequeued.wait_for(lock, std::chrono::microseconds(CAPACITY_WAIT_INTERVAL_US));
+        }
+        waiters--;
+    }
+
+    // Called after every successful dequeue; takes the lock only if an enqueue waits
+    void notifyDequeue() {
+        if (waiters.load() != 0) {
+            std::lock_guard<std::mutex> lock(waitLock);
+            dequeued.notify_all();
+        }
+    }
+
+private:
+    uint64_t maxItems;
+    size_t maxNodeBytes;
+    std::atomic<int> waiters;
+    std::mutex waitLock;
+    std::condition_variable dequeued;
+};
+
+#endif /* CAPACITY_H_ */
@@ -0,0 +1,155 @@
+#pragma once
+
+#ifndef EXECUTOR_H_
+#define EXECUTOR_H_
+
+#if __cplusplus < 202002L
+#error "executor.h requires C++20 coroutines (-std=c++20)"
+#endif
+
+#include <coroutine>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <exception>
+
+#define EXECUTOR_POLL_INTERVAL_US 20 /* how often idle workers re-check the conditions awaited with waitUntil */
+
+/*
+A fire-and-forget coroutine, started by Executor::spawn. Its frame is destroyed when it returns.
+*/
+class Task {
+public:
+    struct promise_type {
+        Task get_return_object() {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    explicit Task(std::coroutine_handle<promise_type> h) :
+        handle(h)
+    {}
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+/*
+A few worker threads that run many coroutines. A coroutine runs on a worker until it suspends,
+and is resumed on whichever worker picks it up next, so it should take its queue thread id from
+Executor::threadId() at every operation rather than keep one.
+Worker i gets thread id firstThreadId + i; threadInit runs on each worker before anything else,
+e.g. for initializing its alloc and volatileAlloc.
+*/
+class Executor {
+public:
+    Executor(int numThreads, int firstThreadId, std::function<void(int)> threadInit = nullptr) :
+        stop(false)
+    {
+        for (int i = 0; i < numThreads; i++) {
+            workers.push_back(std::thread(&Executor::run, this, firstThreadId + i, threadInit));
+        }
+    }
+
+    // Coroutines that did not finish are abandoned
+    ~Executor() {
+        {
+            std::lock_guard<std::mutex> lock(executorLock);
+            stop = true;
+        }
+        wakeup.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    void spawn(Task task) {
+        schedule(task.handle);
+    }
+
+    void schedule(std::coroutine_handle<> handle) {
+        {
+            std::lock_guard<std::mutex> lock(executorLock);
+            ready.push_back(handle);
+        }
+        wakeup.notify_one();
+    }
+
+    // Resume handle once condition() holds; workers evaluate it between coroutines, and every EXECUTOR_POLL_INTERVAL_US when idle
+    void waitUntil(std::function<bool()> condition, std::coroutine_handle<> handle) {
+        std::lock_guard<std::mutex> lock(executorLock);
+        polled.push_back(Polled{condition, handle});
+    }
+
+    // The queue thread id of the calling worker, -1 on other threads
+    static int threadId() {
+        return currentThreadId;
+    }
+
+private:
+    struct Polled {
+        std::function<bool()> condition;
+        std::coroutine_handle<> handle;
+    };
+
+    std::vector<std::thread> workers;
+    std::deque<std::coroutine_handle<>> ready;
+    std::vector<Polled> polled;
+    std::mutex executorLock;
+    std::condition_variable wakeup;
+    bool stop;
+
+    static inline thread_local int currentThreadId = -1;
+
+    // Called with executorLock held
+    void pollConditions() {
+        for (size_t i = 0; i < polled.size(); ) {
+            if (polled[i].condition()) {
+                ready.push_back(polled[i].handle);
+                polled[i] = polled.back();
+                polled.pop_back();
+            } else {
+                i++;
+            }
+        }
+    }
+
+    void run(int threadId, std::function<void(int)> threadInit) {
+        currentThreadId = threadId;
+        if (threadInit) {
+            threadInit(threadId);
+        }
+
+        std::unique_lock<std::mutex> lock(executorLock);
+        while (true) {
+            if (!polled.empty()) {
+                pollConditions();
+            }
+            if (!ready.empty()) {
+                std::coroutine_handle<> handle = ready.front();
+                ready.pop_front();
+                lock.unlock();
+                handle.resume();
+                lock.lock();
+                continue;
+            }
+            if (stop) {
+                return;
+            }
+            if (polled.empty()) {
+                wakeup.wait(lock);
+            } else {
+                wakeup.wait_for(lock, std::chrono::microseconds(EXECUTOR_POLL_INTERVAL_US));
+            }
+        }
+    }
+};
+
+#endif /* EXECUTOR_H_ */
@@ -0,0 +1,167 @@
+#pragma once
+
+#ifndef FLUSHER_H_
+#define FLUSHER_H_
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <deque>
+#include <functional>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+
+#include "utilities.h"
+
+#define FLUSHER_RING_SIZE 1024 /* entries in each producer's ring, must be a power of 2 */
+
+/*
+A dedicated flusher thread, pinned to its own core.
+Producers publish the addresses they would have flushed into their own single-producer single-consumer ring,
+and the flusher writes them back in rounds: a round takes everything published before it started,
+issues a clwb per address and a single sfence, and then completes.
+A producer that needs durability takes a ticket after publishing and waits until that round completes,
+or, if it must not block, registers a callback with whenPersisted, which the flusher runs once the round completes.
+Waiters are kept in ticket order, so completing a round wakes exactly the waiters of that round.
+*/
+class Flusher {
+public:
+    Flusher(int cpu) :
+        startedRound(0),
+        completedRound(0),
+        numWaiters(0),
+        stop(false)
+    {
+        for (int i = 0; i < MAX_THREADS; i++) {
+            rings[i].head.store(0, std::memory_order_relaxed);
+            rings[i].tail.store(0, std::memory_order_relaxed);
+        }
+        flusherThread = std::thread(&Flusher::run, this, cpu);
+    }
+
+    ~Flusher() {
+        stop.store(true);
+        flusherThread.join();
+    }
+
+    void publish(volatile void* p, int threadId) {
+        Ring& ring = rings[threadId];
+        uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+        while (tail - ring.head.load(std::memory_order_acquire) == FLUSHER_RING_SIZE) {
+            // The ring is full, wait for the flusher to drain it
+        }
+        ring.entries[tail & (FLUSHER_RING_SIZE - 1)] = p;
+        // seq_cst, so that a ticket taken afterwards refers to a round that reads this tail
+        ring.tail.store(tail + 1);
+    }
+
+    // The round that is guaranteed to write back everything published so far by the calling thread
+    uint64_t ticket() {
+        return startedRound.load() + 1;
+    }
+
+    bool isPersisted(uint64_t ticket) {
+        return completedRound.load(std::memory_order_acquire) >= ticket;
+    }
+
+    void waitPersisted(uint64_t ticket) {
+        while (!isPersisted(ticket)) {}
+    }
+
+    // Run callback on the flusher thread once ticket's round completes. Returns false, without registering it,
+    // if the round already completed. The callback should be short, e.g. scheduling a coroutine.
+    bool whenPersisted(uint64_t ticket, std::function<void()> callback) {
+        std::lock_guard<std::mutex> lock(waitersLock);
+        // Counted before the check, so that a round completing meanwhile either is seen by it or sees the waiter
+        numWaiters.fetch_add(1);
+        if (isPersisted(ticket)) {
+            numWaiters.fetch_sub(1, std::memory_order_relaxed);
+            return false;
+        }
+        auto position = waiters.end();
+        while (position != waiters.begin() && std::prev(position)->ticket > ticket) {
+            position--;
+        }
+        waiters.insert(position, Waiter{ticket, std::move(callback)});
+        return true;
+    }
+
+private:
+    struct Ring {
+        std::atomic<uint64_t> head CACHE_LINE_ALIGNED; // advanced by the flusher only
+        std::atomic<uint64_t> tail CACHE_LINE_ALIGNED; // advanced by the producer only
+        volatile void* entries[FLUSHER_RING_SIZE] CACHE_LINE_ALIGNED;
+    };
+
+    struct Waiter {
+        uint64_t ticket;
+        std::function<void()> callback;
+    };
+
+    Ring rings[MAX_THREADS];
+    uint64_t drainedUpTo[MAX_THREADS];
+    std::atomic<uint64_t> startedRound DOUBLE_CACHE_LINE_ALIGNED;
+    std::atomic<uint64_t> completedRound DOUBLE_CACHE_LINE_ALIGNED;
+    std::atomic<uint64_t> numWaiters;
+    std::deque<Waiter> waiters; // In ticket order
+    std::mutex waitersLock;
+    std::atomic<bool> stop;
+    std::thread flusherThread;
+
+    void pinToCpu(int cpu) {
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        CPU_SET(cpu, &cpuSet);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuSet);
+    }
+
+    void run(int cpu) {
+        pinToCpu(cpu);
+
+        while (!stop.load(std::memory_order_relaxed)) {
+            uint64_t round = startedRound.fetch_add(1) + 1;
+
+            bool didFlush = false;
+            for (int i = 0; i < MAX_THREADS; i++) {
+                uint64_t head = rings[i].head.load(std::memory_order_relaxed);
+                uint64_t tail = rings[i].tail.load();
+                for (; head != tail; head++) {
+                    FLUSH(rings[i].entries[head & (FLUSHER_RING_SIZE - 1)]);
+                    didFlush = true;
+                }
+                drainedUpTo[i] = tail;
+            }
+            if (didFlush) {
+                SFENCE();
+            }
+
+            // Ring slots are handed back only after the sfence, so that a full ring means unpersisted entries
+            for (int i = 0; i < MAX_THREADS; i++) {
+                rings[i].head.store(drainedUpTo[i], std::memory_order_release);
+            }
+            // seq_cst, so that it is ordered with the load of numWaiters
+            completedRound.store(round);
+            if (numWaiters.load() != 0) {
+                wakeWaiters(round);
+            }
+        }
+    }
+
+    void wakeWaiters(uint64_t round) {
+        std::deque<Waiter> persisted;
+        {
+            std::lock_guard<std::mutex> lock(waitersLock);
+            while (!waiters.empty() && waiters.front().ticket <= round) {
+                persisted.push_back(std::move(waiters.front()));
+                waiters.pop_front();
+            }
+            numWaiters.fetch_sub(persisted.size(), std::memory_order_relaxed);
+        }
+        for (auto& waiter : persisted) {
+            waiter.callback();
+        }
+    }
+};
+
+#endif /* FLUSHER_H_ */
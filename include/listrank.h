@@ -0,0 +1,119 @@
+#pragma once
+
+#ifndef LIST_RANK_H_
+#define LIST_RANK_H_
+
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <stdint.h>
+
+#include <ssmem.h>
+
+#include "utilities.h"
+
+#define NO_SLOT UINT64_MAX
+
+/*
+The nodes of an allocator's chunks, numbered by their position in the chunks (their slot),
+as recovery scans them. slotOf maps a node pointer read from persistent memory back to its slot,
+or to NO_SLOT if it does not point at a node of the chunks.
+*/
+template<class Node> class NodeSlots {
+public:
+    NodeSlots() :
+        nodesPerChunk(SSMEM_DEFAULT_MEM_SIZE / sizeof(Node))
+    {}
+
+    void build(ssmem_allocator_t* a) {
+        chunks.clear();
+        for (auto curr = a->mem_chunks; curr != nullptr; curr = curr->next) {
+            chunks.push_back(static_cast<Node*>(curr->obj));
+        }
+        std::sort(chunks.begin(), chunks.end());
+    }
+
+    uint64_t size() const {
+        return chunks.size() * nodesPerChunk;
+    }
+
+    Node* nodeAt(uint64_t slot) const {
+        return chunks[slot / nodesPerChunk] + slot % nodesPerChunk;
+    }
+
+    uint64_t slotOf(Node* node) const {
+        auto chunk = std::upper_bound(chunks.begin(), chunks.end(), node);
+        if (chunk == chunks.begin()) {
+            return NO_SLOT;
+        }
+        chunk--;
+        uintptr_t offset = (uintptr_t)node - (uintptr_t)*chunk;
+        if (offset >= nodesPerChunk * sizeof(Node) || offset % sizeof(Node) != 0) {
+            return NO_SLOT;
+        }
+        return (chunk - chunks.begin()) * nodesPerChunk + offset / sizeof(Node);
+    }
+
+private:
+    std::vector<Node*> chunks; // Sorted by address
+    uint64_t nodesPerChunk;
+};
+
+// f(begin, end) on numThreads contiguous ranges of [0, n), the first one on the calling thread
+template<class F> void forEachRange(int numThreads, uint64_t n, F f) {
+    std::vector<std::thread> workers;
+    uint64_t rangeSize = (n + numThreads - 1) / numThreads;
+    for (int w = 1; w < numThreads; w++) {
+        uint64_t begin = std::min(n, w * rangeSize);
+        workers.push_back(std::thread(f, begin, std::min(n, begin + rangeSize)));
+    }
+    f(0, std::min(n, rangeSize));
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+/*
+List ranking by pointer jumping (Wyllie's algorithm), on numThreads threads.
+successor[i] is the slot that follows slot i in its list, or i itself if i ends its list.
+On return, last[i] is the slot that ends the list of i, and rank[i] the number of links from i to it.
+Each round doubles the distance every slot jumps, so the longest list of length L takes log2(L) rounds
+of independent work, instead of L dependent cache misses of a walk.
+Stale pointers may form cycles, which never end; the rounds stop once every list that ends did,
+leaving the slots that lead into a cycle with a last that has a successor.
+*/
+inline void rankLists(const std::vector<uint64_t>& successor, int numThreads,
+    std::vector<uint64_t>& last, std::vector<uint64_t>& rank) {
+    uint64_t n = successor.size();
+    last = successor;
+    rank.assign(n, 0);
+    forEachRange(numThreads, n, [&](uint64_t begin, uint64_t end) {
+        for (uint64_t i = begin; i < end; i++) {
+            rank[i] = (successor[i] != i);
+        }
+    });
+
+    std::vector<uint64_t> nextLast(n);
+    std::vector<uint64_t> nextRank(n);
+    std::atomic<bool> changed(true);
+    for (uint64_t reach = 1; changed.load() && reach < 2 * n; reach *= 2) {
+        changed.store(false);
+        forEachRange(numThreads, n, [&](uint64_t begin, uint64_t end) {
+            bool rangeChanged = false;
+            for (uint64_t i = begin; i < end; i++) {
+                uint64_t jump = last[i];
+                nextLast[i] = last[jump];
+                nextRank[i] = rank[i] + rank[jump];
+                rangeChanged |= (nextLast[i] != jump);
+            }
+            if (rangeChanged) {
+                changed.store(true, std::memory_order_relaxed);
+            }
+        });
+        last.swap(nextLast);
+        rank.swap(nextRank);
+    }
+}
+
+#endif /* LIST_RANK_H_ */
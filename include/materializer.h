@@ -0,0 +1,94 @@
+#pragma once
+
+#ifndef MATERIALIZER_H_
+#define MATERIALIZER_H_
+
+#include <atomic>
+#include <vector>
+#include <mutex>
+#include <algorithm>
+
+#include "utilities.h"
+
+#define LAZY_RECOVERY_SEGMENT 4096 /* recovered items a dequeuer materializes as volatile nodes at a time */
+
+/*
+The recovered persistent nodes of a queue that were not materialized as volatile nodes yet, in index order.
+They belong between a boundary node, which has no next node until they are materialized, and the recovered tail,
+which is materialized in recovery for enqueuers. A dequeuer that finds no node after the boundary
+materializes the next LAZY_RECOVERY_SEGMENT of them and links them after it, and the last segment links to the tail.
+*/
+template<class VolatileNode, class PersistentNode> class LazyMaterializer {
+public:
+    LazyMaterializer() :
+        boundary(nullptr),
+        position(0),
+        tail(nullptr)
+    {}
+
+    // nodes are the ones to materialize between after and last
+    void start(VolatileNode* after, std::vector<PersistentNode*>&& nodes, VolatileNode* last) {
+        pending = std::move(nodes);
+        position = 0;
+        tail = last;
+        boundary.store(after);
+    }
+
+    void reset() {
+        boundary.store(nullptr);
+        pending.clear();
+        pending.shrink_to_fit();
+    }
+
+    /*
+    Called when node was found to have no next node. Returns whether it may have one now,
+    either because its segment was materialized or because the caller raced with that.
+    makeNode(persistentNode) returns a new volatile node of persistentNode, with no next node.
+    */
+    template<class F> bool materializeAfter(VolatileNode* node, F makeNode) {
+        if (boundary.load(ORDER_ACQUIRE) == nullptr) {
+            // All were materialized, possibly after node's next was read
+            return node->next.load(ORDER_ACQUIRE) != nullptr;
+        }
+
+        std::lock_guard<std::mutex> lock(materializeLock);
+        if (node->next.load(ORDER_ACQUIRE) != nullptr) {
+            return true;
+        }
+        if (boundary.load(ORDER_RELAXED) != node) {
+            return false; // node is the tail, or behind the boundary as a stale head
+        }
+
+        size_t end = std::min(position + LAZY_RECOVERY_SEGMENT, pending.size());
+        VolatileNode* first = makeNode(pending[position]);
+        VolatileNode* last = first;
+        for (size_t i = position + 1; i < end; i++) {
+            VolatileNode* volatileNode = makeNode(pending[i]);
+            last->next.store(volatileNode, ORDER_RELAXED);
+            last = volatileNode;
+        }
+        position = end;
+
+        bool isLastSegment = (end == pending.size());
+        if (isLastSegment) {
+            last->next.store(tail, ORDER_RELAXED);
+        }
+        // Linked before the boundary moves, so a dequeuer that sees the new boundary finds the segment
+        node->next.store(first, ORDER_RELEASE);
+        if (isLastSegment) {
+            reset();
+        } else {
+            boundary.store(last, ORDER_RELEASE);
+        }
+        return true;
+    }
+
+private:
+    std::atomic<VolatileNode*> boundary; // nullptr once all were materialized
+    std::vector<PersistentNode*> pending;
+    size_t position; // Of the next one to materialize in pending
+    VolatileNode* tail;
+    std::mutex materializeLock;
+};
+
+#endif /* MATERIALIZER_H_ */
@@ -0,0 +1,59 @@
+#pragma once
+
+#ifndef PURGE_H_
+#define PURGE_H_
+
+#include <deque>
+#include <stdint.h>
+
+#include "utilities.h"
+
+#define PURGE_RECLAIM_BATCH 64 /* purged nodes a thread frees in each of its later queue operations */
+
+/*
+The nodes a thread cut off the head of a queue with purgeUntil, still to be freed.
+They form runs of consecutive nodes, each linked by next from its first node up to the new head, and are freed
+a batch at a time by the thread that purged them, so that a purge of millions of items does not
+stall on freeing them. The new head index is persisted before a run is added, so the nodes
+are not part of the queue anymore in recovery either.
+*/
+template<class Node> class PurgedNodes {
+public:
+    // The run of the nodes from first up to, not including, end
+    void add(Node* first, Node* end) {
+        runs.push_back(Run{first, end});
+    }
+
+    bool isEmpty() const {
+        return runs.empty();
+    }
+
+    // Free up to maxNodes nodes with retire(node)
+    template<class F> void reclaim(uint64_t maxNodes, F retire) {
+        while (maxNodes != 0 && !runs.empty()) {
+            Run& run = runs.front();
+            Node* next = run.first->next.load(std::memory_order_relaxed);
+            retire(run.first);
+            run.first = next;
+            maxNodes--;
+            if (run.first == run.end) {
+                runs.pop_front();
+            }
+        }
+    }
+
+    // Forget the runs without freeing them, as recovery reclaims their nodes
+    void clear() {
+        runs.clear();
+    }
+
+private:
+    struct Run {
+        Node* first;
+        Node* end;
+    };
+
+    std::deque<Run> runs;
+} CACHE_LINE_ALIGNED;
+
+#endif /* PURGE_H_ */
@@ -0,0 +1,165 @@
+#pragma once
+
+#ifndef REPLICATION_H_
+#define REPLICATION_H_
+
+#include <atomic>
+#include <new>
+#include <type_traits>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "utilities.h"
+
+#define REPLICATION_RING_MAGIC 0x52504c52 /* marks a ring whose header was initialized */
+
+/*
+A ring in shared memory through which a primary queue streams what it persisted to a standby process:
+the records of the enqueued items, each published once its node is persisted, and the advances of the head index,
+each published once it is persisted. The primary's threads publish concurrently, so item records may arrive
+out of index order; the standby reorders them. A single standby consumes the ring.
+If the standby falls capacity records behind, later records are dropped and the ring is marked overflowed,
+so that a lagging or dead standby never stalls the primary; the standby is then out of sync and must be reseeded.
+*/
+template<class T> class ReplicationRing {
+    static_assert(std::is_trivially_copyable<T>::value, "replicated items are copied as they are in memory");
+
+public:
+    enum RecordKind : uint64_t { Item = 1, Head = 2 };
+
+    struct Record {
+        RecordKind kind;
+        uint64_t index; // Of the item, or the new head index
+        T item;
+    };
+
+    // baseIndex is the tail index of the primary queue when it starts publishing to the ring
+    static ReplicationRing* create(const char* name, uint64_t capacity, uint64_t baseIndex) {
+        int fd = shm_open(name, O_CREAT | O_TRUNC | O_RDWR, 0600);
+        if (fd == -1) {
+            return nullptr;
+        }
+        size_t size = mappingSize(capacity);
+        void* mapping = (ftruncate(fd, size) == 0) ?
+            mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (mapping == MAP_FAILED) {
+            return nullptr;
+        }
+
+        ReplicationRing* ring = new (mapping) ReplicationRing(capacity, baseIndex);
+        for (uint64_t i = 0; i < capacity; i++) {
+            new (&ring->slots()[i]) Slot();
+            ring->slots()[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        ring->magic.store(REPLICATION_RING_MAGIC, std::memory_order_release);
+        return ring;
+    }
+
+    // Returns nullptr if the ring does not exist or was not initialized yet
+    static ReplicationRing* attach(const char* name) {
+        int fd = shm_open(name, O_RDWR, 0600);
+        if (fd == -1) {
+            return nullptr;
+        }
+        void* mapping = mmap(nullptr, sizeof(ReplicationRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        uint64_t capacity = 0;
+        if (mapping != MAP_FAILED) {
+            ReplicationRing* header = static_cast<ReplicationRing*>(mapping);
+            if (header->magic.load(std::memory_order_acquire) == REPLICATION_RING_MAGIC) {
+                capacity = header->capacity;
+            }
+            munmap(mapping, sizeof(ReplicationRing));
+        }
+        mapping = (capacity != 0) ?
+            mmap(nullptr, mappingSize(capacity), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        close(fd);
+        return (mapping == MAP_FAILED) ? nullptr : static_cast<ReplicationRing*>(mapping);
+    }
+
+    // Unmaps the ring from this process; the last process to use it should also shm_unlink its name
+    static void detach(ReplicationRing* ring) {
+        munmap(ring, mappingSize(ring->capacity));
+    }
+
+    bool publishItem(uint64_t index, const T& item) {
+        return publish(Item, index, item);
+    }
+
+    bool publishHead(uint64_t headIndex) {
+        return publish(Head, headIndex, T());
+    }
+
+    // By the standby only. Returns false if no record is ready.
+    bool consume(Record& record) {
+        uint64_t position = consumed.load(std::memory_order_relaxed);
+        Slot& slot = slots()[position % capacity];
+        if (slot.sequence.load(std::memory_order_acquire) != position + 1) {
+            return false;
+        }
+        record = slot.record;
+        slot.sequence.store(position + capacity, std::memory_order_relaxed);
+        consumed.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool isOverflowed() const {
+        return overflowed.load(std::memory_order_acquire);
+    }
+
+    uint64_t getBaseIndex() const {
+        return baseIndex;
+    }
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> sequence; // position + 1 once the record of position was written
+        Record record;
+    } CACHE_LINE_ALIGNED;
+
+    std::atomic<uint32_t> magic;
+    uint64_t capacity;
+    uint64_t baseIndex;
+    std::atomic<bool> overflowed;
+    std::atomic<uint64_t> published CACHE_LINE_ALIGNED; // Positions claimed by publishers
+    std::atomic<uint64_t> consumed CACHE_LINE_ALIGNED;
+
+    ReplicationRing(uint64_t ringCapacity, uint64_t base) :
+        magic(0),
+        capacity(ringCapacity),
+        baseIndex(base),
+        overflowed(false),
+        published(0),
+        consumed(0)
+    {}
+
+    static size_t mappingSize(uint64_t capacity) {
+        return sizeof(ReplicationRing) + capacity * sizeof(Slot);
+    }
+
+    Slot* slots() {
+        return reinterpret_cast<Slot*>(this + 1);
+    }
+
+    bool publish(RecordKind kind, uint64_t index, const T& item) {
+        uint64_t position = published.load(std::memory_order_relaxed);
+        do {
+            if (position - consumed.load(std::memory_order_acquire) >= capacity) {
+                overflowed.store(true, std::memory_order_release);
+                return false;
+            }
+        } while (!published.compare_exchange_weak(position, position + 1, std::memory_order_relaxed));
+
+        // The slot was consumed, as position is less than capacity positions ahead of consumed
+        Slot& slot = slots()[position % capacity];
+        slot.record.kind = kind;
+        slot.record.index = index;
+        slot.record.item = item;
+        slot.sequence.store(position + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+#endif /* REPLICATION_H_ */
@@ -35,9 +35,40 @@
 #include <malloc.h>
 #include <assert.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 
 #include "utilities.h"
 
+#if !defined(MAP_SYNC)
+#define MAP_SYNC 0x80000
+#endif
+#if !defined(MAP_SHARED_VALIDATE)
+#define MAP_SHARED_VALIDATE 0x03
+#endif
+#if !defined(MAP_FIXED_NOREPLACE)
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+#define SSMEM_POOL_MAGIC      0x324c4f504d454d53ULL /* "SMEMPOL2", a header with the base address */
+#define SSMEM_POOL_ALIGNMENT  4096
+#define SSMEM_POOL_DATA_START (((sizeof(ssmem_pool_header_t) + SSMEM_POOL_ALIGNMENT - 1) / SSMEM_POOL_ALIGNMENT) * SSMEM_POOL_ALIGNMENT)
+
+typedef struct ssmem_pool
+{
+  ssmem_pool_header_t *header;	/* the beginning of the mapping */
+  size_t size;
+  int numa_node;
+} ssmem_pool_t;
+
+ssmem_pool_t ssmem_pools[SSMEM_POOL_MAX];
+uint32_t ssmem_pools_num = 0;
+ssmem_pool_policy_t ssmem_pool_policy = SSMEM_POOL_BY_THREAD;
+volatile uint32_t ssmem_pool_next = 0;
+
 ssmem_ts_t *ssmem_ts_list = nullptr;
 volatile uint32_t ssmem_ts_list_len = 0;
 __thread volatile ssmem_ts_t *ssmem_ts_local = nullptr;
@@ -56,6 +87,8 @@ ssmem_get_id()
 
 static ssmem_list_t *ssmem_list_node_new(void *mem, ssmem_list_t *next);
 static void ssmem_zero_memory(ssmem_allocator_t *a);
+static void *ssmem_chunk_alloc(ssmem_allocator_t *a, size_t size, int id);
+static void ssmem_chunk_free(void *mem);
 
 /* 
  * explicitely subscribe to the list of threads in order to used timestamps for GC
@@ -89,17 +122,14 @@ ssmem_free_set_t *ssmem_free_set_new(size_t size, ssmem_free_set_t *next);
  * If the thread is not subscribed to the list of timestamps (used for GC),
  * additionally subscribe the thread to the list
  */
-void ssmem_alloc_init_fs_size(ssmem_allocator_t *a, size_t size, size_t free_set_size, int id)
+static void
+ssmem_alloc_init_internal(ssmem_allocator_t *a, size_t size, size_t free_set_size, int id, int pooled)
 {
     ssmem_num_allocators++;
     ssmem_allocator_list = ssmem_list_node_new((void *)a, ssmem_allocator_list);
 
-#if SSMEM_TRANSPARENT_HUGE_PAGES
-    int ret = posix_memalign(&a->mem, CACHE_LINE_SIZE, size);
-    assert(ret == 0);
-#else
-    a->mem = (void *)aligned_alloc(CACHE_LINE_SIZE, size);
-#endif
+    a->pooled = pooled;
+    a->mem = ssmem_chunk_alloc(a, size, id);
     assert(a->mem != nullptr);
 
     a->mem_curr = 0;
@@ -131,6 +161,20 @@ void ssmem_alloc_init_fs_size(ssmem_allocator_t *a, size_t size, size_t free_set
     a->released_num = 0;
 }
 
+void ssmem_alloc_init_fs_size(ssmem_allocator_t *a, size_t size, size_t free_set_size, int id)
+{
+    ssmem_alloc_init_internal(a, size, free_set_size, id, 0);
+}
+
+/* 
+ * initialize allocator a with the default SSMEM_GC_FREE_SET_SIZE, taking its mem chunks
+ * from the backing pools (if no pool was added, they are allocated as usual)
+ */
+void ssmem_alloc_init_pooled(ssmem_allocator_t *a, size_t size, int id)
+{
+    ssmem_alloc_init_internal(a, size, SSMEM_GC_FREE_SET_SIZE, id, 1);
+}
+
 /* 
  * initialize allocator a with the default SSMEM_GC_FREE_SET_SIZE
  * If the thread is not subscribed to the list of timestamps (used for GC),
@@ -249,7 +293,7 @@ void ssmem_alloc_term(ssmem_allocator_t *a)
     do
     {
         ssmem_list_t *mnxt = mcur->next;
-        free(mcur->obj);
+        ssmem_chunk_free(mcur->obj);
         free(mcur);
         mcur = mnxt;
     } while (mcur != nullptr);
@@ -442,12 +486,7 @@ ssmem_alloc(ssmem_allocator_t *a, size_t size)
                 }
                 /* printf("[ALLOC] new mem size chunk is %llu MB\n", a->mem_size / (1024 * 1024LL)); */
             }
-#if SSMEM_TRANSPARENT_HUGE_PAGES
-            int ret = posix_memalign(&a->mem, CACHE_LINE_SIZE, a->mem_size);
-            assert(ret == 0);
-#else
-            a->mem = (void *)aligned_alloc(CACHE_LINE_SIZE, a->mem_size);
-#endif
+            a->mem = ssmem_chunk_alloc(a, a->mem_size, ssmem_get_id());
             assert(a->mem != nullptr);
 
             a->mem_curr = 0;
@@ -527,9 +566,9 @@ int ssmem_mem_reclaim(ssmem_allocator_t *a)
             do
             {
                 rel_cur = rel_nxt;
+                rel_nxt = rel_nxt->next;
                 free(rel_cur->mem);
                 free(rel_cur);
-                rel_nxt = rel_nxt->next;
             } while (rel_nxt != nullptr);
         }
     }
@@ -608,7 +647,7 @@ void ssmem_free(ssmem_allocator_t *a, void *obj)
 /* 
  *
  */
-inline void
+void
 ssmem_release(ssmem_allocator_t *a, void *obj)
 {
     ssmem_released_t *rel_list = a->released_mem_list;
@@ -733,4 +772,276 @@ void ssmem_zero_memory(ssmem_allocator_t *a) {
     }
     // SFENCE is not required here, since an SFENCE will be placed next, after creating a new node for the mem_chunks list
 #endif
-}
\ No newline at end of file
+}
+
+/* **************************************************************************************** */
+/* backing pools */
+/* **************************************************************************************** */
+
+/* 
+ * map path as a backing pool, initializing its header unless it already holds one
+ */
+int ssmem_pool_add(const char *path, size_t size, int numa_node)
+{
+    if (ssmem_pools_num == SSMEM_POOL_MAX)
+    {
+        fprintf(stderr, "[ALLOC] ssmem_pool_add: at most %d pools are supported\n", SSMEM_POOL_MAX);
+        return -1;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (fd < 0)
+    {
+        perror("[ALLOC] ssmem_pool_add: open");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        perror("[ALLOC] ssmem_pool_add: fstat");
+        close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size >= SSMEM_POOL_DATA_START)
+    {
+        size = st.st_size; /* an existing pool keeps its size */
+    }
+    else if (size <= SSMEM_POOL_DATA_START || ftruncate(fd, size) != 0)
+    {
+        fprintf(stderr, "[ALLOC] ssmem_pool_add: cannot size %s to %zu bytes\n", path, size);
+        close(fd);
+        return -1;
+    }
+
+    /* the nodes in a pool hold absolute pointers, so an existing pool is mapped at its base address again */
+    uint64_t existing[3]; /* the magic, size and base fields of the header */
+    void *base = nullptr;
+    int fixed = 0;
+    if (pread(fd, existing, sizeof(existing), 0) == (ssize_t)sizeof(existing) &&
+        existing[0] == SSMEM_POOL_MAGIC && existing[1] == size)
+    {
+        base = (void *)existing[2];
+        fixed = MAP_FIXED_NOREPLACE;
+    }
+
+    /* MAP_SYNC guarantees that flushed stores are durable without msync, but only on DAX */
+    void *mem = mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED_VALIDATE | MAP_SYNC | fixed, fd, 0);
+    if (mem == MAP_FAILED)
+    {
+        mem = mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | fixed, fd, 0);
+    }
+    close(fd);
+    if (mem == MAP_FAILED)
+    {
+        perror("[ALLOC] ssmem_pool_add: mmap");
+        return -1;
+    }
+    if (fixed && mem != base) /* kernels before 4.17 take the address as a hint only */
+    {
+        munmap(mem, size);
+        fprintf(stderr, "[ALLOC] ssmem_pool_add: the base address %p of %s is taken\n", base, path);
+        return -1;
+    }
+
+    ssmem_pool_header_t *header = (ssmem_pool_header_t *)mem;
+    if (!fixed)
+    {
+        memset(header, 0, sizeof(ssmem_pool_header_t));
+        header->size = size;
+        header->base = (uint64_t)mem;
+        header->used = SSMEM_POOL_DATA_START;
+        for (size_t i = 0; i < sizeof(ssmem_pool_header_t); i += CACHE_LINE_SIZE)
+        {
+            FLUSH((int8_t *)header + i);
+        }
+        SFENCE();
+        /* the magic number marks the header as initialized */
+        header->magic = SSMEM_POOL_MAGIC;
+        FLUSH(&header->magic);
+        SFENCE();
+    }
+
+    int index = ssmem_pools_num;
+    ssmem_pools[index].header = header;
+    ssmem_pools[index].size = size;
+    ssmem_pools[index].numa_node = numa_node;
+    ssmem_pools_num++;
+    return index;
+}
+
+void ssmem_pool_set_policy(ssmem_pool_policy_t policy)
+{
+    ssmem_pool_policy = policy;
+}
+
+uint32_t ssmem_pool_num()
+{
+    return ssmem_pools_num;
+}
+
+/* 
+ * carve a chunk from pool p, or return nullptr if p is full
+ */
+static void *
+ssmem_pool_chunk_alloc(ssmem_pool_t *p, size_t size)
+{
+    ssmem_pool_header_t *header = p->header;
+    size = ((size + SSMEM_POOL_ALIGNMENT - 1) / SSMEM_POOL_ALIGNMENT) * SSMEM_POOL_ALIGNMENT;
+
+    if (header->used + size > header->size || header->chunks_num >= SSMEM_POOL_MAX_CHUNKS)
+    {
+        return nullptr;
+    }
+    /* the entry is reserved first, so that no space is carved for a chunk that cannot be recorded;
+     an entry whose chunk did not fit keeps offset 0 and is skipped */
+    uint64_t i = __sync_fetch_and_add(&header->chunks_num, 1);
+    if (i >= SSMEM_POOL_MAX_CHUNKS)
+    {
+        return nullptr;
+    }
+    uint64_t offset = __sync_fetch_and_add(&header->used, size);
+    if (offset + size > header->size)
+    {
+        return nullptr;
+    }
+
+    header->chunks[i].size = size;
+    header->chunks[i].offset = offset;
+    FLUSH(&header->used);
+    FLUSH(&header->chunks[i]);
+    SFENCE();
+
+    return (void *)((char *)header + offset);
+}
+
+static int
+ssmem_current_numa_node()
+{
+    unsigned int cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0)
+    {
+        return -1;
+    }
+    return node;
+}
+
+/* 
+ * allocate a mem chunk, from the backing pools if a is pooled
+ */
+static void *
+ssmem_chunk_alloc(ssmem_allocator_t *a, size_t size, int id)
+{
+    uint32_t num = ssmem_pools_num;
+    if (a->pooled && num > 0)
+    {
+        uint32_t first;
+        switch (ssmem_pool_policy)
+        {
+        case SSMEM_POOL_BY_THREAD:
+            first = (id >= 0 ? id : 0) % num;
+            break;
+        case SSMEM_POOL_BY_NUMA_NODE:
+        {
+            int node = ssmem_current_numa_node();
+            first = FAI_U32(&ssmem_pool_next) % num;
+            for (uint32_t i = 0; i < num; i++)
+            {
+                if (ssmem_pools[(first + i) % num].numa_node == node)
+                {
+                    first = (first + i) % num;
+                    break;
+                }
+            }
+            break;
+        }
+        default:
+            first = FAI_U32(&ssmem_pool_next) % num;
+            break;
+        }
+
+        for (uint32_t i = 0; i < num; i++)
+        {
+            void *mem = ssmem_pool_chunk_alloc(&ssmem_pools[(first + i) % num], size);
+            if (mem != nullptr)
+            {
+                return mem;
+            }
+        }
+        /* printf("[ALLOC] all pools are full, allocating from the heap\n"); */
+    }
+
+    void *mem;
+#if SSMEM_TRANSPARENT_HUGE_PAGES
+    int ret = posix_memalign(&mem, CACHE_LINE_SIZE, size);
+    assert(ret == 0);
+#else
+    mem = (void *)aligned_alloc(CACHE_LINE_SIZE, size);
+#endif
+    return mem;
+}
+
+/* 
+ * pool chunks are never returned; the pools are bump-allocated only
+ */
+static void
+ssmem_chunk_free(void *mem)
+{
+    for (uint32_t i = 0; i < ssmem_pools_num; i++)
+    {
+        char *start = (char *)ssmem_pools[i].header;
+        if ((char *)mem >= start && (char *)mem < start + ssmem_pools[i].size)
+        {
+            return;
+        }
+    }
+    free(mem);
+}
+
+/* 
+ * make the chunks of every pool, including those of other allocators before a crash, mem chunks of a
+ */
+void ssmem_alloc_adopt_pool_chunks(ssmem_allocator_t *a)
+{
+    for (uint32_t i = 0; i < ssmem_pools_num; i++)
+    {
+        ssmem_pool_header_t *header = ssmem_pools[i].header;
+        uint64_t chunks_num = header->chunks_num;
+        if (chunks_num > SSMEM_POOL_MAX_CHUNKS)
+        {
+            chunks_num = SSMEM_POOL_MAX_CHUNKS;
+        }
+        for (uint64_t c = 0; c < chunks_num; c++)
+        {
+            if (header->chunks[c].offset == 0) /* reserved, but not written before a crash */
+            {
+                continue;
+            }
+            void *mem = (void *)((char *)header + header->chunks[c].offset);
+
+            int found = 0;
+            for (ssmem_list_t *cur = a->mem_chunks; cur != nullptr; cur = cur->next)
+            {
+                if (cur->obj == mem)
+                {
+                    found = 1;
+                    break;
+                }
+            }
+            if (found)
+            {
+                continue;
+            }
+
+            struct ssmem_list* new_mem_chunks = ssmem_list_node_new(mem, a->mem_chunks);
+            FLUSH(new_mem_chunks);
+            SFENCE();
+
+            a->mem_chunks = new_mem_chunks;
+            FLUSH(&a->mem_chunks);
+            SFENCE();
+        }
+    }
+
+    a->mem_curr = a->mem_size;
+}
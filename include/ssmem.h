@@ -52,6 +52,8 @@
                  for memory again and again */
 #define SSMEM_MEM_SIZE_MAX     (4 * 1024 * 1024 * 1024LL) /* absolute max chunk size 
                                (e.g., if doubling is 1) */
+#define SSMEM_POOL_MAX         16   /* max number of backing pools (e.g., one DAX file per DIMM set) */
+#define SSMEM_POOL_MAX_CHUNKS  4096 /* max number of chunks carved from a single pool */
 
 /* increase the thread-local timestamp of activity on each ssmem_alloc() and/or ssmem_free() 
    call. If enabled (>0), after some memory is alloced and/or freed, the thread should not 
@@ -101,6 +103,7 @@ typedef struct ALIGNED(CACHE_LINE_SIZE) ssmem_allocator
                           and can be used as free sets */
       size_t released_num;	/* number of released memory objects */
       struct ssmem_released* released_mem_list; /* list of release memory objects */
+      int pooled;		/* whether the mem chunks are carved from the backing pools */
     };
     uint8_t padding[2 * CACHE_LINE_SIZE];
   };
@@ -159,6 +162,32 @@ typedef struct ssmem_list
   struct ssmem_list* next;
 } ssmem_list_t;
 
+/*
+ * a backing pool: a file (e.g., on a DAX file system) mapped in its entirety. Its header
+ * persistently records the chunks carved from it, so that they can be found in recovery.
+ */
+typedef struct ssmem_pool_header
+{
+  uint64_t magic;
+  uint64_t size;		/* size of the mapped file */
+  uint64_t base;		/* the address the file is mapped at, the same in every run */
+  volatile uint64_t used;	/* offset of the first byte not carved yet */
+  volatile uint64_t chunks_num;	/* number of reserved entries in chunks */
+  struct
+  {
+    uint64_t size;
+    uint64_t offset;		/* 0 until the entry is written */
+  } chunks[SSMEM_POOL_MAX_CHUNKS];
+} ssmem_pool_header_t;
+
+/* how the pool of a new mem chunk is chosen; a full pool is skipped */
+typedef enum
+{
+  SSMEM_POOL_BY_THREAD,		/* the pool of the allocator's thread id */
+  SSMEM_POOL_BY_NUMA_NODE,	/* a pool on the numa node the thread runs on */
+  SSMEM_POOL_ROUND_ROBIN	/* the next pool */
+} ssmem_pool_policy_t;
+
 /* **************************************************************************************** */
 /* ssmem interface */
 /* **************************************************************************************** */
@@ -167,6 +196,8 @@ typedef struct ssmem_list
 void ssmem_alloc_init(ssmem_allocator_t* a, size_t size, int id);
 /* initialize an allocator and give the number of objects in free_sets */
 void ssmem_alloc_init_fs_size(ssmem_allocator_t* a, size_t size, size_t free_set_size, int id);
+/* initialize an allocator whose mem chunks are interleaved across the backing pools */
+void ssmem_alloc_init_pooled(ssmem_allocator_t* a, size_t size, int id);
 /* explicitely subscribe to the list of threads in order to used timestamps for GC */
 void ssmem_gc_thread_init(ssmem_allocator_t* a, int id);
 /* terminate the system (all allocators) and free all memory */
@@ -184,6 +215,17 @@ void ssmem_free(ssmem_allocator_t* a, void* obj);
 /* release some memory to the OS using allocator a */
 void ssmem_release(ssmem_allocator_t* a, void* obj);
 
+/* map the file in path as a backing pool, creating it with the given size if it is not a pool
+ yet, and associate it with a numa node (-1 for none). An existing pool is mapped at the address
+ it was created at, and adding it fails if that address is taken. Not thread-safe: add all pools before
+ initializing pooled allocators. Returns the index of the pool or -1 on failure */
+int ssmem_pool_add(const char* path, size_t size, int numa_node);
+void ssmem_pool_set_policy(ssmem_pool_policy_t policy);
+uint32_t ssmem_pool_num();
+/* add the chunks of all pools to the mem chunks of a, so that recovery scans all of them.
+ The current chunk of a is considered used up, as recovery takes care of its free memory */
+void ssmem_alloc_adopt_pool_chunks(ssmem_allocator_t* a);
+
 /* increment the thread-local activity counter. Invoking this function suggests that
  no memory references to ssmem-allocated memory are held by the current thread beyond
 this point. */
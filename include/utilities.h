@@ -7,6 +7,9 @@
 #include <stddef.h> //for null
 #include <climits>  //for max int
 #include <fstream>
+#include <algorithm>
+#include <stdint.h>
+#include <string.h>
 
 #define MAX_THREADS 256
 
@@ -14,16 +17,117 @@
 #define CACHE_LINE_ALIGNED __attribute__((aligned (CACHE_LINE_SIZE)))
 #define DOUBLE_CACHE_LINE_ALIGNED __attribute__((aligned (2 * CACHE_LINE_SIZE)))
 
+#define DEFERRED_FLUSH          0  /* record FLUSH calls in a per-thread set and write them back,
+                                      deduplicated and sorted, just before the next SFENCE */
+#define DEFERRED_FLUSH_SET_SIZE 64 /* recorded cache lines before the set is written back early */
+#ifndef WEAK_MEMORY_ORDERS
+#define WEAK_MEMORY_ORDERS      1  /* the queues' atomics on the operations' paths use the weakest memory orders
+                                      they are correct with, instead of seq_cst; -DWEAK_MEMORY_ORDERS=0 to compare */
+#endif
+
+#if WEAK_MEMORY_ORDERS
+#define ORDER_RELAXED std::memory_order_relaxed
+#define ORDER_ACQUIRE std::memory_order_acquire
+#define ORDER_RELEASE std::memory_order_release
+#define ORDER_ACQ_REL std::memory_order_acq_rel
+#else
+#define ORDER_RELAXED std::memory_order_seq_cst
+#define ORDER_ACQUIRE std::memory_order_seq_cst
+#define ORDER_RELEASE std::memory_order_seq_cst
+#define ORDER_ACQ_REL std::memory_order_seq_cst
+#endif
+
+// The memory clobber keeps the compiler from moving stores to the line past the write-back,
+// which weaker memory orders of the surrounding atomics would otherwise allow
+static inline void CLWB(volatile void *p)
+{
+    asm volatile ("clwb (%0)" :: "r"(p) : "memory");
+}
+
+#if DEFERRED_FLUSH
+struct DeferredFlushSet
+{
+    uintptr_t lines[DEFERRED_FLUSH_SET_SIZE];
+    int size;
+};
+
+// Not static, so that all translation units share the same per-thread set
+inline DeferredFlushSet& deferredFlushSet()
+{
+    static thread_local DeferredFlushSet set;
+    return set;
+}
+#endif
+
+/*
+Issue the write-backs that were deferred so far, without waiting for them.
+Needed before a locked instruction that is relied on for ordering them, in place of an SFENCE.
+*/
+static inline void ISSUE_FLUSHES()
+{
+#if DEFERRED_FLUSH
+    DeferredFlushSet& set = deferredFlushSet();
+    std::sort(set.lines, set.lines + set.size);
+    uintptr_t* end = std::unique(set.lines, set.lines + set.size);
+    for (uintptr_t* line = set.lines; line != end; line++) {
+        CLWB((volatile void*)*line);
+    }
+    set.size = 0;
+#endif
+}
+
 static inline void FLUSH(volatile void *p)
 {
-    asm volatile ("clwb (%0)" :: "r"(p));
+#if DEFERRED_FLUSH
+    DeferredFlushSet& set = deferredFlushSet();
+    set.lines[set.size++] = (uintptr_t)p & ~(uintptr_t)(CACHE_LINE_SIZE - 1);
+    if (set.size == DEFERRED_FLUSH_SET_SIZE) {
+        ISSUE_FLUSHES();
+    }
+#else
+    CLWB(p);
+#endif
+}
+
+// Write back every cache line of [p, p + size), with no ordering between them
+static inline void FLUSH_RANGE(volatile void *p, size_t size)
+{
+    uintptr_t line = (uintptr_t)p & ~(uintptr_t)(CACHE_LINE_SIZE - 1);
+    for (; line < (uintptr_t)p + size; line += CACHE_LINE_SIZE) {
+        FLUSH((volatile void*)line);
+    }
 }
 
 static inline void SFENCE()
 {
+    ISSUE_FLUSHES();
     asm volatile ("sfence" ::: "memory");
 }
 
+#define CHECKSUM_SEED 0xcbf29ce484222325UL
+
+/*
+Checksums let recovery tell a fully persisted record from a torn or stale one,
+instead of relying on the order in which the record's fields are persisted.
+Start with CHECKSUM_SEED, fold each field in with checksumUpdate and finish with checksumFinish.
+*/
+static inline uint64_t checksumUpdate(uint64_t hash, const void *data, size_t size)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    for (size_t i = 0; i < size; i += sizeof(uint64_t)) {
+        uint64_t word = 0;
+        memcpy(&word, bytes + i, std::min(sizeof(uint64_t), size - i));
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15UL;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+static inline uint32_t checksumFinish(uint64_t hash)
+{
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
 static inline void __writel(uint32_t val, volatile uint32_t *addr)
 {
 	volatile uint32_t *target = addr;
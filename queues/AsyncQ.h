@@ -0,0 +1,135 @@
+#pragma once
+
+#ifndef ASYNC_Q_H_
+#define ASYNC_Q_H_
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <assert.h>
+
+#include <flusher.h>
+#include <executor.h>
+
+#include "utilities.h"
+
+/*
+Awaitable operations on a queue Q<T>, for coroutines run by an Executor:
+co_await q.deqAsync() returns the next item, suspending while the queue is empty,
+and co_await q.enqDurable(item) resumes once the item is persisted.
+A suspended dequeuer holds no thread. The enqueue that finds one waiting dequeues on its behalf
+and schedules it, so items enqueued through this wrapper's enq (or enqDurable) are handed to waiting coroutines;
+items enqueued directly to the queue are only found by later dequeues.
+If the queue has a flusher, pass the same one, for enqDurable to wait for its rounds rather than for a fence.
+*/
+template<template<class> class Q, class T> class AsyncQ {
+private:
+    struct DeqAwaiter {
+        AsyncQ* owner;
+        T item;
+        std::coroutine_handle<> handle;
+
+        bool await_ready() {
+            return owner->queue->deq(&item, owner->threadId());
+        }
+
+        bool await_suspend(std::coroutine_handle<> h) {
+            handle = h;
+            return owner->suspendUntilItem(this);
+        }
+
+        T await_resume() {
+            return item;
+        }
+    };
+
+    struct EnqDurableAwaiter {
+        AsyncQ* owner;
+        T item;
+        uint64_t ticket;
+
+        bool await_ready() {
+            owner->enq(item, owner->threadId());
+            if (!owner->flusher) {
+                SFENCE(); // The queue flushed the node in-line
+                return true;
+            }
+            ticket = owner->flusher->ticket();
+            return owner->flusher->isPersisted(ticket);
+        }
+
+        // The flusher schedules h when the ticket's round completes; resumes at once if it already did
+        bool await_suspend(std::coroutine_handle<> h) {
+            Executor* executor = owner->executor;
+            return owner->flusher->whenPersisted(ticket, [executor, h] { executor->schedule(h); });
+        }
+
+        void await_resume() {}
+    };
+
+public:
+    AsyncQ(Q<T>* q, Executor* e, Flusher* f = nullptr) :
+        queue(q),
+        executor(e),
+        flusher(f),
+        numWaiters(0)
+    {}
+
+    DeqAwaiter deqAsync() {
+        return DeqAwaiter{this, T(), nullptr};
+    }
+
+    EnqDurableAwaiter enqDurable(T item) {
+        return EnqDurableAwaiter{this, item, 0};
+    }
+
+    // For enqueuers that are not coroutines of the executor
+    void enq(T item, int threadId) {
+        queue->enq(item, threadId);
+        handOff(threadId);
+    }
+
+private:
+    Q<T>* queue;
+    Executor* executor;
+    Flusher* flusher;
+
+    // Volatile
+    std::atomic<int> numWaiters;
+    std::deque<DeqAwaiter*> waiters;
+    std::mutex waitersLock;
+
+    int threadId() {
+        int id = Executor::threadId();
+        assert(id >= 0); // Awaited outside the executor's workers
+        return id;
+    }
+
+    // Returns false, without waiting, if an item was dequeued meanwhile
+    bool suspendUntilItem(DeqAwaiter* waiter) {
+        std::lock_guard<std::mutex> lock(waitersLock);
+        // Counted before the last attempt, so that an enqueue either is seen by it or sees the waiter
+        numWaiters.fetch_add(1);
+        if (queue->deq(&waiter->item, threadId())) {
+            numWaiters.fetch_sub(1);
+            return false;
+        }
+        waiters.push_back(waiter);
+        return true;
+    }
+
+    void handOff(int threadId) {
+        if (numWaiters.load() == 0) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(waitersLock);
+        if (!waiters.empty() && queue->deq(&waiters.front()->item, threadId)) {
+            DeqAwaiter* waiter = waiters.front();
+            waiters.pop_front();
+            numWaiters.fetch_sub(1);
+            executor->schedule(waiter->handle);
+        }
+    }
+};
+
+#endif /* ASYNC_Q_H_ */
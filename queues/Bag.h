@@ -0,0 +1,419 @@
+#pragma once
+
+#ifndef BAG_H_
+#define BAG_H_
+
+#include <atomic>
+#include <set>
+#include <vector>
+#include <algorithm>
+
+#include <ssmem.h>
+
+#include "utilities.h"
+
+#define BAG_BLOCK_SIZE 64 /* item slots of a block */
+
+/*
+A durable unordered bag. Each thread adds to the newest block of its own list of persistent blocks,
+at a position only it advances, so adds share no CAS and no cache line with other adders.
+A thread removes from its own newest block first, last added first, then from its older blocks,
+and then steals from the lists of the other threads, from the one it last stole from.
+A removal takes a slot by a CAS on its state, whose version changes with every add to the slot.
+The blocks are the persistent representation, so recovery follows each thread's list from its persistent head,
+and only recomputes the adding positions.
+*/
+template<class T> class Bag {
+private:
+    struct Slot {
+        T item;
+        uint32_t checksum; // Over the item and the state, written before the state
+        std::atomic<uint64_t> state; // The slot's version, above the Full and RemovalPersisted bits
+    };
+
+    class Block {
+    public:
+        std::atomic<Block*> next; // The next older block of the same list
+        uint32_t owner; // The id of the bag the block was allocated for
+        uint32_t thread; // The id of the thread whose list it is in
+        Slot slots[BAG_BLOCK_SIZE];
+    } __attribute__((aligned (64)));
+
+    static const uint64_t Full = 1;
+    static const uint64_t RemovalPersisted = 2; // Volatile meaning only, set once a removal was fenced
+    static const int VersionShift = 2;
+
+    template<class Q> friend class QueueRegistry;
+
+public:
+    // Bags whose blocks share an allocator must have distinct ids, for telling their blocks apart in recovery
+    Bag(uint32_t id = 1) :
+        numLists(0),
+        queueId(id)
+    {
+        for (int i = 0; i < MAX_THREADS; i++) {
+            localData[i].head.store(nullptr, ORDER_RELAXED);
+            FLUSH(&localData[i].head);
+            initializeLocalData(i);
+        }
+        SFENCE();
+    }
+
+    void add(T item, int threadId) {
+        registerList(threadId);
+        LocalData& local = localData[threadId];
+        if (local.head.load(ORDER_RELAXED) == nullptr || local.position == BAG_BLOCK_SIZE) {
+            addBlock(threadId);
+        }
+
+        // The slots at and above position are empty, and only this thread fills them
+        Slot& slot = local.head.load(ORDER_RELAXED)->slots[local.position++];
+        uint64_t state = (((slot.state.load(ORDER_RELAXED) >> VersionShift) + 1) << VersionShift) | Full;
+        slot.item = item;
+        slot.checksum = computeChecksum(item, state);
+        // Counted before it can be seen, so that a remover that saw no new adds saw every item
+        local.numAdds.store(local.numAdds.load(ORDER_RELAXED) + 1, ORDER_RELEASE);
+        local.numItems.fetch_add(1, ORDER_RELEASE);
+        slot.state.store(state, ORDER_RELEASE);
+        FLUSH_RANGE(&slot, sizeof(Slot));
+        SFENCE();
+    }
+
+    // Returns false if the bag was empty at some point during the call
+    bool remove(T* removedItem, int threadId) {
+        LocalData& local = localData[threadId];
+        while (local.position > 0) {
+            if (tryTake(threadId, local.head.load(ORDER_RELAXED)->slots[--local.position], removedItem)) {
+                return true;
+            }
+        }
+
+        uint64_t numAdds[MAX_THREADS];
+        std::vector<Block*> emptiedBlocks; // Unlinked by this call, and freed when it returns
+        while (true) {
+            int n = numLists.load(ORDER_ACQUIRE);
+            for (int i = 0; i < n; i++) {
+                numAdds[i] = localData[i].numAdds.load(ORDER_ACQUIRE);
+            }
+
+            bool didFlush = false;
+            bool isFound = threadId < n && takeFromList(threadId, removedItem, didFlush, emptiedBlocks);
+            for (int k = 0; k < n && !isFound; k++) {
+                int victim = (local.victim + k) % n;
+                if (victim != threadId && takeFromList(victim, removedItem, didFlush, emptiedBlocks)) {
+                    local.victim = victim;
+                    isFound = true;
+                }
+            }
+
+            if (isFound || isUnchanged(numAdds, n)) {
+                // The removals of the items that were seen removed must be durable before reporting the empty state
+                if (didFlush && !isFound) {
+                    SFENCE();
+                }
+                freeBlocks(emptiedBlocks);
+                return isFound;
+            }
+        }
+    }
+
+    void recover() {
+        Recovery recovery;
+        recoverBegin(recovery);
+
+        retireNonQueueNodes(recovery); // retiring alloc's blocks
+
+        std::vector<Block*> blocks(recovery.blocks.begin(), recovery.blocks.end());
+        recoverEnd(recovery, blocks);
+    }
+
+private:
+    struct LocalData {
+        std::atomic<Block*> head CACHE_LINE_ALIGNED; // The thread's newest block
+        int position; // Volatile, of the next add in head
+        int victim; // Volatile, the thread it last stole from
+        std::atomic<uint64_t> numAdds CACHE_LINE_ALIGNED; // Volatile, read by removers that find no item
+        std::atomic<int64_t> numItems; // Volatile, at least the number of items in the list whose removals are not persisted
+        std::atomic<bool> isUnlinking; // Volatile, held by the one thread that may unlink blocks from the list
+    } DOUBLE_CACHE_LINE_ALIGNED;
+
+    LocalData localData[MAX_THREADS];
+    std::atomic<int> numLists DOUBLE_CACHE_LINE_ALIGNED; // Volatile, lists 0..numLists-1 might be non-empty
+    uint32_t queueId;
+
+    static uint32_t computeChecksum(const T& item, uint64_t state) {
+        uint64_t hash = CHECKSUM_SEED;
+        hash = checksumUpdate(hash, &item, sizeof(item));
+        hash = checksumUpdate(hash, &state, sizeof(state));
+        return checksumFinish(hash);
+    }
+
+    void initializeLocalData(int threadId) {
+        localData[threadId].position = 0;
+        localData[threadId].victim = threadId + 1;
+        localData[threadId].numAdds.store(0, ORDER_RELAXED);
+        localData[threadId].numItems.store(0, ORDER_RELAXED);
+        localData[threadId].isUnlinking.store(false, ORDER_RELAXED);
+    }
+
+    void registerList(int threadId) {
+        int n = numLists.load(ORDER_RELAXED);
+        while (n <= threadId && !numLists.compare_exchange_weak(n, threadId + 1)) {}
+    }
+
+    bool tryTake(int listId, Slot& slot, T* removedItem) {
+        uint64_t state = slot.state.load(ORDER_ACQUIRE);
+        if ((state & Full) == 0) {
+            return false;
+        }
+        T item = slot.item; // Read before the CAS, after which the owner may fill the slot again
+        uint64_t removedState = state & ~(Full | RemovalPersisted);
+        if (!slot.state.compare_exchange_strong(state, removedState, ORDER_ACQ_REL, ORDER_RELAXED)) {
+            return false;
+        }
+        FLUSH(&slot.state);
+        SFENCE();
+        localData[listId].numItems.fetch_sub(1, ORDER_RELEASE);
+        // Unless the owner filled the slot again meanwhile
+        slot.state.compare_exchange_strong(removedState, removedState | RemovalPersisted, ORDER_RELEASE, ORDER_RELAXED);
+        *removedItem = item;
+        return true;
+    }
+
+    /*
+    Flushes the slots whose removals may not be persisted yet, for the caller to fence if it finds no item.
+    A list whose count is 0 holds no item, and its removals were fenced.
+    Older blocks found emptied are unlinked, unless another thread is unlinking from the list, so that later removers
+    do not scan them again; they are added to emptiedBlocks, for the caller to free once it no longer reads blocks.
+    */
+    bool takeFromList(int listId, T* removedItem, bool& didFlush, std::vector<Block*>& emptiedBlocks) {
+        if (localData[listId].numItems.load(ORDER_ACQUIRE) <= 0) {
+            return false;
+        }
+        Block* head = localData[listId].head.load(ORDER_ACQUIRE);
+        bool isFound = false;
+        bool sawEmptied = false;
+        for (Block* block = head; block != nullptr && !isFound; block = block->next.load(ORDER_ACQUIRE)) {
+            bool isBlockEmpty = true;
+            for (int i = 0; i < BAG_BLOCK_SIZE; i++) {
+                Slot& slot = block->slots[i];
+                if (tryTake(listId, slot, removedItem)) {
+                    isFound = true;
+                    break;
+                }
+                uint64_t state = slot.state.load(ORDER_ACQUIRE);
+                if ((state & (Full | RemovalPersisted)) == 0) {
+                    FLUSH(&slot.state);
+                    didFlush = true;
+                }
+                isBlockEmpty &= (state & Full) == 0;
+            }
+            sawEmptied |= (block != head && isBlockEmpty && !isFound);
+        }
+
+        LocalData& list = localData[listId];
+        if (sawEmptied && !list.isUnlinking.exchange(true, ORDER_ACQUIRE)) {
+            if (unlinkEmptied(list.head.load(ORDER_ACQUIRE), emptiedBlocks)) {
+                SFENCE();
+            }
+            list.isUnlinking.store(false, ORDER_RELEASE);
+        }
+        return isFound;
+    }
+
+    // Unlink the emptied blocks after block, with the list's isUnlinking held. Returns whether a flush was issued.
+    static bool unlinkEmptied(Block* block, std::vector<Block*>& emptiedBlocks) {
+        bool didFlush = false;
+        Block* pred = block;
+        for (Block* curr = block->next.load(ORDER_ACQUIRE); curr != nullptr; curr = curr->next.load(ORDER_ACQUIRE)) {
+            if (isEmpty(curr)) {
+                // curr keeps its next pointer, for the removers that are reading it
+                pred->next.store(curr->next.load(ORDER_RELAXED), ORDER_RELEASE);
+                FLUSH(&pred->next);
+                emptiedBlocks.push_back(curr);
+                didFlush = true;
+            } else {
+                pred = curr;
+            }
+        }
+        return didFlush;
+    }
+
+    static void freeBlocks(std::vector<Block*>& blocks) {
+        for (Block* block : blocks) {
+            ssmem_free(alloc, block);
+        }
+    }
+
+    // No list gained an item since numAdds was read, so every item that was in the bag then was removed by now
+    bool isUnchanged(uint64_t* numAdds, int n) {
+        if (numLists.load(ORDER_ACQUIRE) != n) {
+            return false;
+        }
+        for (int i = 0; i < n; i++) {
+            if (localData[i].numAdds.load(ORDER_ACQUIRE) != numAdds[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Only the owner fills a block, and only its newest one, so an older block that was emptied stays empty
+    static bool isEmpty(Block* block) {
+        for (int i = 0; i < BAG_BLOCK_SIZE; i++) {
+            if (block->slots[i].state.load(ORDER_ACQUIRE) & Full) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Push a new block to the thread's list, whose head is full, unlinking the blocks that were emptied
+    // unless a remover is unlinking from the list
+    void addBlock(int threadId) {
+        LocalData& local = localData[threadId];
+        std::vector<Block*> emptiedBlocks;
+
+        Block* first = local.head.load(ORDER_RELAXED);
+        bool isUnlinking = !local.isUnlinking.exchange(true, ORDER_ACQUIRE);
+        if (isUnlinking) {
+            while (first != nullptr && isEmpty(first)) {
+                emptiedBlocks.push_back(first);
+                first = first->next.load(ORDER_RELAXED);
+            }
+            if (first != nullptr) {
+                unlinkEmptied(first, emptiedBlocks);
+            }
+        }
+
+        Block* block = static_cast<Block*>(ssmem_alloc(alloc, sizeof(Block)));
+        block->next.store(first, ORDER_RELAXED);
+        block->owner = queueId;
+        block->thread = threadId;
+        for (int i = 0; i < BAG_BLOCK_SIZE; i++) {
+            block->slots[i].state.store(RemovalPersisted, ORDER_RELAXED);
+        }
+        FLUSH_RANGE(block, sizeof(Block));
+        SFENCE();
+
+        local.head.store(block, ORDER_RELEASE);
+        FLUSH(&local.head);
+        SFENCE();
+        local.position = 0;
+        if (isUnlinking) {
+            local.isUnlinking.store(false, ORDER_RELEASE);
+        }
+
+        freeBlocks(emptiedBlocks);
+    }
+
+    /*
+    Recovery is split into phases, so that QueueRegistry can recover all the bags sharing alloc
+    with a single scan of its chunks:
+    recoverBegin, then isQueueNode or retireNonQueueNode on every block of the chunks, then recoverEnd.
+    */
+    typedef Block RecoveryNode;
+
+    struct Recovery {
+        std::set<Block*> blocks;
+    };
+
+    static uint32_t ownerOf(Block* block) {
+        return block->owner;
+    }
+
+    // A list is cut at its first block that is not one of the thread's, if any
+    void recoverBegin(Recovery& recovery) {
+        bool didFlush = false;
+        for (int i = 0; i < MAX_THREADS; i++) {
+            std::atomic<Block*>* link = &localData[i].head;
+            Block* block = link->load(ORDER_RELAXED);
+            while (block != nullptr && block->owner == queueId && block->thread == (uint32_t)i &&
+                recovery.blocks.find(block) == recovery.blocks.end()) {
+                recovery.blocks.insert(block);
+                link = &block->next;
+                block = link->load(ORDER_RELAXED);
+            }
+            if (block != nullptr) {
+                link->store(nullptr, ORDER_RELAXED);
+                FLUSH(link);
+                didFlush = true;
+            }
+        }
+        if (didFlush) {
+            SFENCE();
+        }
+    }
+
+    bool isQueueNode(const Recovery& recovery, Block* block) {
+        return recovery.blocks.find(block) != recovery.blocks.end();
+    }
+
+    // Returns whether a flush was issued. Nothing to clear: only the lists are followed, and a new block is reset.
+    bool retireNonQueueNode(const Recovery& recovery, Block* block) {
+        return false;
+    }
+
+    static bool retireOrphanNode(Block* block) {
+        return false;
+    }
+
+    // Clear the slots of torn adds, and recompute each thread's adding position in its newest block and its count
+    void recoverEnd(Recovery& recovery, std::vector<Block*>& blocks) {
+        for (int i = 0; i < MAX_THREADS; i++) {
+            initializeLocalData(i);
+        }
+
+        bool didFlush = false;
+        for (Block* block : blocks) {
+            for (int i = 0; i < BAG_BLOCK_SIZE; i++) {
+                Slot& slot = block->slots[i];
+                uint64_t state = slot.state.load(ORDER_RELAXED);
+                if ((state & Full) && slot.checksum != computeChecksum(slot.item, state)) {
+                    slot.state.store((state & ~Full) | RemovalPersisted, ORDER_RELAXED);
+                    FLUSH(&slot.state);
+                    didFlush = true;
+                } else if ((state & Full) == 0) {
+                    slot.state.store(state | RemovalPersisted, ORDER_RELAXED);
+                } else {
+                    localData[block->thread].numItems.fetch_add(1, ORDER_RELAXED);
+                }
+            }
+        }
+
+        int n = 0;
+        for (int i = 0; i < MAX_THREADS; i++) {
+            Block* head = localData[i].head.load(ORDER_RELAXED);
+            if (head == nullptr) {
+                continue;
+            }
+            n = i + 1;
+            for (int j = BAG_BLOCK_SIZE; j > 0; j--) {
+                if (head->slots[j - 1].state.load(ORDER_RELAXED) & Full) {
+                    localData[i].position = j;
+                    break;
+                }
+            }
+        }
+        numLists.store(n);
+
+        if (didFlush) {
+            SFENCE();
+        }
+    }
+
+    void retireNonQueueNodes(Recovery& recovery) {
+        for (auto curr = alloc->mem_chunks; curr != nullptr; curr = curr->next) {
+            Block* currChunk = static_cast<Block*>(curr->obj);
+            uint64_t numOfBlocks = SSMEM_DEFAULT_MEM_SIZE / sizeof(Block);
+            for (uint64_t i = 0; i < numOfBlocks; i++) {
+                Block* currBlock = currChunk + i;
+                if (!isQueueNode(recovery, currBlock)) {
+                    ssmem_free(alloc, currBlock);
+                }
+            }
+        }
+    }
+};
+
+#endif /* BAG_H_ */
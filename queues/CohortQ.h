@@ -0,0 +1,285 @@
+#pragma once
+
+#ifndef COHORT_Q_H_
+#define COHORT_Q_H_
+
+#include <atomic>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <ssmem.h>
+
+#include "utilities.h"
+#include "OptUnlinkedQ.h"
+#include "QueueRegistry.h"
+
+#define COHORT_MAX_NODES    8  /* NUMA nodes a CohortQ can span */
+#define COHORT_BATCH_SIZE   64 /* items of one node that enter the global order as a unit */
+#define COHORT_LOCAL_WINDOW 4  /* batches at the head of the global order among which a dequeuer prefers a local one */
+#define COHORT_MAX_BYPASSES 16 /* consecutive local items a dequeuer takes ahead of an older remote batch */
+#define COHORT_COVER_PERIOD 8  /* batches a dequeuer uses up between covers of the uncovered items of all nodes */
+
+/*
+A NUMA-cohort queue: one OptUnlinkedQ per NUMA node, and a global order kept at batch granularity.
+Threads enqueue to the sub-queue of their node, and the enqueue that completes COHORT_BATCH_SIZE items
+of a node no batch accounts for appends a batch of them to a global chain, with a single CAS on a line shared by all nodes.
+Dequeuers follow the chain, taking a batch's worth of items from its node's sub-queue, and prefer a batch
+of their own node if one is among the first COHORT_LOCAL_WINDOW batches, or else an uncovered item of their node;
+this is the FIFO relaxation. It is bounded: after COHORT_MAX_BYPASSES consecutive local items taken ahead of
+an older remote batch, a dequeuer serves the first batch of the chain, so remote items are not starved.
+The dequeuer that uses up a batch appends the uncovered items of its own node as a batch, and every
+COHORT_COVER_PERIOD batches, or when the chain runs empty, those of all nodes, so the items of a node
+without local dequeuers enter the global order even if their node enqueues no more.
+The chain is a hint: items it does not account for yet are found by scanning the sub-queues, local one first.
+The sub-queues are durable and recovered together through a QueueRegistry, so the allocators of the threads
+that use a CohortQ must serve no other registry or CohortQ or GroupedQ. The chain is volatile,
+so after recovery each node's backlog is drained in turn, before any batch enqueued later.
+*/
+template<class T> class CohortQ {
+private:
+    struct Batch {
+        int node;
+        std::atomic<int64_t> remaining; // Items still to be taken on behalf of this batch
+        std::atomic<Batch*> next;
+    } __attribute__((aligned (32)));
+
+    // Batches share volatileAlloc with the sub-queues' nodes, and ssmem hands out freed memory for any size
+    typedef typename OptUnlinkedQ<T>::VolatileNode SubQueueNode;
+    static_assert(sizeof(Batch) <= sizeof(SubQueueNode), "a batch must fit in the memory of a sub-queue node");
+
+    Batch* allocBatch(int node, int64_t size) {
+        Batch* batch = static_cast<Batch*>(ssmem_alloc(volatileAlloc, sizeof(SubQueueNode)));
+        batch->node = node;
+        batch->remaining.store(size, ORDER_RELAXED);
+        batch->next.store(nullptr, ORDER_RELAXED);
+        return batch;
+    }
+
+public:
+    CohortQ(int nodes) :
+        numNodes(nodes)
+    {
+        assert(nodes >= 1 && nodes <= COHORT_MAX_NODES);
+        for (int i = 0; i < numNodes; i++) {
+            char name[QUEUE_NAME_SIZE];
+            snprintf(name, QUEUE_NAME_SIZE, "node%d", i);
+            subQueues[i] = registry.openOrCreate(name);
+            FLUSH(&subQueues[i]);
+        }
+        SFENCE();
+        initializeVolatileState();
+    }
+
+    // Overrides the node of a thread, which is otherwise the node it runs on when it first uses the queue
+    void setThreadNode(int threadId, int node) {
+        localData[threadId].node = node % numNodes;
+    }
+
+    bool deq(T* dequeuedItem, int threadId) {
+        int localNode = nodeOf(threadId);
+        LocalData& local = localData[threadId];
+        while (true) {
+            retireExhaustedBatches();
+
+            Batch* first = nullptr;
+            Batch* firstLocal = nullptr;
+            int i = 0;
+            for (Batch* batch = chainHead.load(ORDER_ACQUIRE)->next.load(ORDER_ACQUIRE);
+                 batch != nullptr && i < COHORT_LOCAL_WINDOW; batch = batch->next.load(ORDER_ACQUIRE), i++) {
+                if (batch->remaining.load(ORDER_RELAXED) <= 0) {
+                    continue;
+                }
+                if (first == nullptr) {
+                    first = batch;
+                }
+                if (batch->node == localNode) {
+                    firstLocal = batch;
+                    break;
+                }
+            }
+
+            Batch* chosen = first;
+            if (first == nullptr || first->node != localNode) {
+                bool mayBypass = first == nullptr || local.bypasses < COHORT_MAX_BYPASSES;
+                if (mayBypass && firstLocal != nullptr) {
+                    chosen = firstLocal;
+                } else if (mayBypass && claimUncovered(localNode)) {
+                    if (first != nullptr) {
+                        local.bypasses++;
+                    }
+                    if (subQueues[localNode]->deq(dequeuedItem, threadId)) {
+                        return true;
+                    }
+                    continue; // Taken by a scan or by the drain of a recovered backlog
+                }
+            }
+            if (chosen == nullptr) {
+                if (coverUncovered(0, numNodes)) {
+                    continue;
+                }
+                break;
+            }
+            local.bypasses = chosen == first ? 0 : local.bypasses + 1;
+
+            int64_t remaining = chosen->remaining.fetch_sub(1, ORDER_RELAXED);
+            if (remaining <= 0) {
+                continue; // Taken up meanwhile
+            }
+            if (remaining == 1) {
+                if (++local.usedUpBatches % COHORT_COVER_PERIOD == 0) {
+                    coverUncovered(0, numNodes);
+                } else {
+                    coverUncovered(localNode, localNode + 1);
+                }
+            }
+            if (subQueues[chosen->node]->deq(dequeuedItem, threadId)) {
+                return true;
+            }
+            // The rest of the batch was taken by scans, or by the drain of a recovered backlog
+            chosen->remaining.store(0, ORDER_RELAXED);
+        }
+
+        for (int i = 0; i < numNodes; i++) {
+            if (subQueues[(localNode + i) % numNodes]->deq(dequeuedItem, threadId)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void enq(T item, int threadId) {
+        int node = nodeOf(threadId);
+        subQueues[node]->enq(item, threadId);
+        // Counted once it is in the sub-queue, so a dequeuer that claims it is likely to find an item
+        std::atomic<int64_t>& uncovered = uncoveredCounts[node].count;
+        int64_t count = uncovered.fetch_add(1, ORDER_RELAXED) + 1;
+        while (count >= COHORT_BATCH_SIZE) {
+            if (uncovered.compare_exchange_weak(count, count - COHORT_BATCH_SIZE, ORDER_RELAXED)) {
+                appendBatch(allocBatch(node, COHORT_BATCH_SIZE));
+                break;
+            }
+        }
+    }
+
+    // numThreads threads recover the sub-queues; see QueueRegistry::recoverAll
+    void recover(int numThreads = 1, std::function<void(int)> threadInit = nullptr) {
+        registry.recoverAll(numThreads, threadInit);
+        initializeVolatileState();
+        for (int i = 0; i < numNodes; i++) {
+            appendBatch(allocBatch(i, INT64_MAX)); // Drains the recovered items of the node
+        }
+    }
+
+private:
+    QueueRegistry<OptUnlinkedQ<T>> registry;
+    OptUnlinkedQ<T>* subQueues[COHORT_MAX_NODES];
+    int numNodes;
+
+    // Volatile
+    std::atomic<Batch*> chainHead DOUBLE_CACHE_LINE_ALIGNED;
+    std::atomic<Batch*> chainTail DOUBLE_CACHE_LINE_ALIGNED;
+
+    struct UncoveredCount {
+        std::atomic<int64_t> count; // Items of the node's sub-queue that no batch accounts for
+    } DOUBLE_CACHE_LINE_ALIGNED;
+
+    UncoveredCount uncoveredCounts[COHORT_MAX_NODES];
+
+    struct LocalData {
+        int node;
+        int bypasses;           // Consecutive local items taken ahead of an older remote batch
+        uint64_t usedUpBatches;
+    } CACHE_LINE_ALIGNED;
+
+    LocalData localData[MAX_THREADS];
+
+    void initializeVolatileState() {
+        Batch* dummyBatch = allocBatch(-1, 0);
+        chainHead.store(dummyBatch, ORDER_RELEASE);
+        chainTail.store(dummyBatch, ORDER_RELEASE);
+        for (int i = 0; i < COHORT_MAX_NODES; i++) {
+            uncoveredCounts[i].count.store(0, ORDER_RELAXED);
+        }
+        for (int i = 0; i < MAX_THREADS; i++) {
+            localData[i].node = -1;
+            localData[i].bypasses = 0;
+            localData[i].usedUpBatches = 0;
+        }
+    }
+
+    int nodeOf(int threadId) {
+        if (localData[threadId].node == -1) {
+            unsigned int cpu, node;
+            if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) {
+                node = 0;
+            }
+            localData[threadId].node = node % numNodes;
+        }
+        return localData[threadId].node;
+    }
+
+    bool claimUncovered(int node) {
+        int64_t count = uncoveredCounts[node].count.load(ORDER_RELAXED);
+        while (count > 0) {
+            if (uncoveredCounts[node].count.compare_exchange_weak(count, count - 1, ORDER_RELAXED)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Append a batch of the uncovered items of each node in [fromNode, toNode). Returns whether any was appended.
+    bool coverUncovered(int fromNode, int toNode) {
+        bool didAppend = false;
+        for (int i = fromNode; i < toNode; i++) {
+            if (uncoveredCounts[i].count.load(ORDER_RELAXED) == 0) {
+                continue;
+            }
+            int64_t count = uncoveredCounts[i].count.exchange(0, ORDER_RELAXED);
+            if (count > 0) {
+                appendBatch(allocBatch(i, count));
+                didAppend = true;
+            }
+        }
+        return didAppend;
+    }
+
+    // The global chain is a Michael-Scott queue of batches
+    void appendBatch(Batch* batch) {
+        while (true) {
+            Batch* tail = chainTail.load(ORDER_ACQUIRE);
+            Batch* tailNext = tail->next.load(ORDER_ACQUIRE);
+            if (tailNext == nullptr) {
+                if (tail->next.compare_exchange_strong(tailNext, batch, ORDER_ACQ_REL)) {
+                    chainTail.compare_exchange_strong(tail, batch, ORDER_ACQ_REL);
+                    return;
+                }
+            } else {
+                chainTail.compare_exchange_strong(tail, tailNext, ORDER_ACQ_REL);
+            }
+        }
+    }
+
+    void retireExhaustedBatches() {
+        while (true) {
+            Batch* head = chainHead.load(ORDER_ACQUIRE);
+            Batch* headNext = head->next.load(ORDER_ACQUIRE);
+            if (headNext == nullptr || headNext->remaining.load(ORDER_RELAXED) > 0) {
+                return;
+            }
+            Batch* tail = chainTail.load(ORDER_ACQUIRE);
+            if (head == tail) {
+                chainTail.compare_exchange_strong(tail, headNext, ORDER_ACQ_REL);
+                continue;
+            }
+            if (chainHead.compare_exchange_strong(head, headNext, ORDER_ACQ_REL)) {
+                ssmem_free(volatileAlloc, head);
+            }
+        }
+    }
+};
+
+#endif /* COHORT_Q_H_ */
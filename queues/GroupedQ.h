@@ -0,0 +1,149 @@
+#pragma once
+
+#ifndef GROUPED_Q_H_
+#define GROUPED_Q_H_
+
+#include <atomic>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "utilities.h"
+#include "OptUnlinkedQ.h"
+#include "QueueRegistry.h"
+
+#define GROUPED_MAX_PARTITIONS 256 /* partitions a GroupedQ can hash its groups to */
+
+/*
+A queue of items with group keys, FIFO per group and consumed in parallel across groups,
+like SQS FIFO message groups or Kafka partitions. Groups are hashed to numPartitions OptUnlinkedQ partitions,
+which are durable and recovered together through a QueueRegistry, so the allocators of the
+threads that use a GroupedQ must serve no other registry or GroupedQ or CohortQ.
+A consumer that receives an item holds its partition in flight until it acknowledges the item with ack,
+which dequeues it, or hands it back with release; meanwhile other consumers receive from other partitions.
+The receipt receive returns names the partition, and ack and release act only for the consumer holding it.
+
+Head-of-line blocking: a partition is held as a whole, so every group hashed to it waits behind its slowest
+group's item in flight. Groups are independent only to the extent that they fall in distinct partitions;
+size numPartitions to the number of groups consumed concurrently, up to GROUPED_MAX_PARTITIONS.
+
+Received items stay in their partition until acknowledged, so after a crash the items that were in flight
+are again at the heads of their partitions and are received first, in order, while the in-flight locks,
+held by consumers that did not survive, are released.
+*/
+template<class T> class GroupedQ {
+private:
+    struct Entry {
+        uint64_t key;
+        T item;
+    };
+
+public:
+    GroupedQ(int partitions) :
+        numPartitions(partitions)
+    {
+        assert(partitions >= 1 && partitions <= GROUPED_MAX_PARTITIONS);
+        for (int i = 0; i < numPartitions; i++) {
+            char name[QUEUE_NAME_SIZE];
+            snprintf(name, QUEUE_NAME_SIZE, "partition%d", i);
+            partitionQueues[i] = registry.openOrCreate(name);
+            FLUSH(&partitionQueues[i]);
+        }
+        SFENCE();
+        initializeVolatileState();
+    }
+
+    void enq(uint64_t key, T item, int threadId) {
+        partitionQueues[partitionOf(key)]->enq(Entry{key, item}, threadId);
+    }
+
+    // Receive the first item of a partition no consumer holds, and hold it until ack or release with receipt.
+    // Returns false if every partition is empty or held.
+    bool receive(uint64_t* key, T* item, int* receipt, int threadId) {
+        int cursor = localData[threadId].cursor;
+        for (int i = 0; i < numPartitions; i++) {
+            int partition = (cursor + i) % numPartitions;
+            int holder = -1;
+            if (holders[partition].holder.load(ORDER_RELAXED) != -1 ||
+                !holders[partition].holder.compare_exchange_strong(holder, threadId, ORDER_ACQUIRE, ORDER_RELAXED)) {
+                continue;
+            }
+            Entry entry;
+            if (partitionQueues[partition]->peek(&entry)) {
+                localData[threadId].cursor = (partition + 1) % numPartitions; // Round robin over the partitions
+                *key = entry.key;
+                *item = entry.item;
+                *receipt = partition;
+                return true;
+            }
+            holders[partition].holder.store(-1, ORDER_RELEASE);
+        }
+        return false;
+    }
+
+    // Complete the item threadId received with receipt: it is dequeued, and the next item of its partition can be received.
+    // Returns false, changing nothing, if threadId does not hold the receipt's partition.
+    bool ack(int receipt, int threadId) {
+        if (!isHolder(receipt, threadId)) {
+            return false;
+        }
+        Entry entry;
+        partitionQueues[receipt]->deq(&entry, threadId);
+        holders[receipt].holder.store(-1, ORDER_RELEASE);
+        return true;
+    }
+
+    // Hand back the item threadId received with receipt, to be received again before the later items of its partition.
+    // Returns false, changing nothing, if threadId does not hold the receipt's partition.
+    bool release(int receipt, int threadId) {
+        if (!isHolder(receipt, threadId)) {
+            return false;
+        }
+        holders[receipt].holder.store(-1, ORDER_RELEASE);
+        return true;
+    }
+
+    // numThreads threads recover the partitions; see QueueRegistry::recoverAll
+    void recover(int numThreads = 1, std::function<void(int)> threadInit = nullptr) {
+        registry.recoverAll(numThreads, threadInit);
+        initializeVolatileState();
+    }
+
+private:
+    QueueRegistry<OptUnlinkedQ<Entry>> registry;
+    OptUnlinkedQ<Entry>* partitionQueues[GROUPED_MAX_PARTITIONS];
+    int numPartitions;
+
+    // Volatile
+    struct Holder {
+        std::atomic<int> holder; // The thread id of the consumer holding the partition, -1 if none
+    } CACHE_LINE_ALIGNED;
+
+    Holder holders[GROUPED_MAX_PARTITIONS];
+
+    struct LocalData {
+        int cursor; // The partition the thread tries first
+    } CACHE_LINE_ALIGNED;
+
+    LocalData localData[MAX_THREADS];
+
+    void initializeVolatileState() {
+        for (int i = 0; i < GROUPED_MAX_PARTITIONS; i++) {
+            holders[i].holder.store(-1);
+        }
+        for (int i = 0; i < MAX_THREADS; i++) {
+            localData[i].cursor = (numPartitions > 0) ? i % numPartitions : 0;
+        }
+    }
+
+    // Only the holder releases a partition, so the holder it reads cannot change before the holder acts
+    bool isHolder(int receipt, int threadId) {
+        return receipt >= 0 && receipt < numPartitions && holders[receipt].holder.load(ORDER_ACQUIRE) == threadId;
+    }
+
+    int partitionOf(uint64_t key) {
+        return (int)(((key * 0x9E3779B97F4A7C15UL) >> 32) % numPartitions); // Fibonacci hashing spreads sequential keys
+    }
+};
+
+#endif /* GROUPED_Q_H_ */
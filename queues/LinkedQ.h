@@ -4,9 +4,13 @@
 #define LINKED_Q_H_
 
 #include <atomic>
-#include <set>
+#include <vector>
+#include <mutex>
 
 #include <ssmem.h>
+#include <flusher.h>
+#include <capacity.h>
+#include <listrank.h>
 
 #include "utilities.h"
 
@@ -17,18 +21,18 @@ private:
         T item;
         std::atomic<Node*> next;
         std::atomic<Node*> pred;
-        bool initialized;
+        uint32_t initialized; // The id of the queue the node was initialized for, 0 until then
 
-        void initialize(T value) {
-            // initialized is guaranteed to be false when node is allocated from pool
+        void initialize(T value, uint32_t queueId) {
+            // initialized is guaranteed to be 0 when node is allocated from pool
             item = value;
-            next = nullptr;
+            next.store(nullptr, ORDER_RELAXED);
             std::atomic_thread_fence(std::memory_order_release);
-            initialized = true;
+            initialized = queueId;
         }
 
-        void initialize() {
-            initialize(T());
+        void initialize(uint32_t queueId) {
+            initialize(T(), queueId);
         }
     } __attribute__((aligned (32)));
 
@@ -37,12 +41,19 @@ private:
         return static_cast<Node*>(node);
     }
 
+    template<class Q> friend class QueueRegistry;
+
 public:
-    LinkedQ() :
+    // Queues whose nodes share an allocator must have distinct ids, for telling their nodes apart in recovery
+    LinkedQ(uint32_t id = 1) :
         Head(allocNode()),
-        Tail(Head.load())
+        Tail(Head.load()),
+        flusher(nullptr),
+        queueId(id),
+        itemCount(0),
+        recoveryThreads(1)
     {
-        Head.load()->initialize();
+        Head.load()->initialize(queueId);
         Head.load()->pred.store(nullptr, std::memory_order_relaxed);
         FLUSH(Head);
         FLUSH(&Head);
@@ -53,16 +64,20 @@ public:
 
     bool deq(T* dequeuedItem, int threadId) {
         while (true) {
-            Node* head = Head.load();
-            Node* headNext = head->next.load();
+            Node* head = Head.load(ORDER_ACQUIRE);
+            Node* headNext = head->next.load(ORDER_ACQUIRE);
             if (headNext == nullptr) {
                 FLUSH(&Head);
                 SFENCE();
                 return false;
             }
             
-            if (Head.compare_exchange_strong(head, headNext)) {
+            if (Head.compare_exchange_strong(head, headNext, ORDER_ACQ_REL, ORDER_RELAXED)) {
                 *dequeuedItem = headNext->item;
+                if (flusher) {
+                    // Head must not be persisted past a node whose write-back is still pending in the flusher
+                    flusher->waitPersisted(flusher->ticket());
+                }
                 if (nodeToPersistAndRetire[threadId].ptr) { // It equals NULL in the first successful deq
                     FLUSH(&(nodeToPersistAndRetire[threadId].ptr->initialized));
                 }
@@ -74,8 +89,13 @@ public:
                 if (nodeToPersistAndRetire[threadId].ptr) { // It equals NULL in the first successful deq
                     ssmem_free(alloc, nodeToPersistAndRetire[threadId].ptr);
                 }
-                head->initialized = false;
+                head->initialized = 0;
                 nodeToPersistAndRetire[threadId].ptr = head;
+
+                if (capacity.isBounded()) {
+                    itemCount.fetch_sub(1, ORDER_RELAXED);
+                }
+                capacity.notifyDequeue();
                 
                 return true;
             }
@@ -84,41 +104,94 @@ public:
 
     void enq(T item, int threadId) {
         Node* newNode = allocNode();
-        newNode->initialize(item);
+        newNode->initialize(item, queueId);
+        if (capacity.isBounded()) {
+            // Counted before it is linked, so that the dequeue of the item never finds the count at 0
+            itemCount.fetch_add(1, ORDER_RELAXED);
+        }
         while (true) {
-            Node* tail = Tail.load();
-            Node* tailNext = tail->next.load();
+            Node* tail = Tail.load(ORDER_ACQUIRE);
+            Node* tailNext = tail->next.load(ORDER_ACQUIRE);
             if (tailNext == nullptr) {
                 newNode->pred.store(tail, std::memory_order_relaxed);
-                if (tail->next.compare_exchange_strong(tailNext, newNode)) {
-                    flushNotPersistedSuffix(newNode);
-                    Tail.compare_exchange_strong(tail, newNode);
+                if (tail->next.compare_exchange_strong(tailNext, newNode, ORDER_RELEASE, ORDER_RELAXED)) {
+                    flushNotPersistedSuffix(newNode, threadId);
+                    ISSUE_FLUSHES();
+                    Tail.compare_exchange_strong(tail, newNode, ORDER_RELEASE, ORDER_RELAXED);
                     newNode->pred.store(nullptr, std::memory_order_relaxed);
                     break;
                 }
             }
-            Tail.compare_exchange_strong(tail, tailNext);
+            Tail.compare_exchange_strong(tail, tailNext, ORDER_RELEASE, ORDER_RELAXED);
         }
     }
 
-    void recover() {
-        initializeNodeToPersistAndRetire();
-
-        std::set<Node*> queueNodes;
-        bool didFlush = getQueueNodesIncludingDummy(queueNodes)
-            || retireNonQueueNodes(queueNodes);
+    // Delegate the write-back of enqueued nodes to a flusher thread; nullptr restores in-line flushing
+    void setFlusher(Flusher* f) {
+        flusher = f;
+    }
 
-        Node* lastNode = *queueNodes.rbegin();
-        setPersistedSuffixAndRecoverTail(lastNode);
-        
-        if (didFlush) {
+    // Wait until the nodes enqueued so far are persisted (without a flusher, the ones the calling thread enqueued)
+    void sync() {
+        if (flusher) {
+            flusher->waitPersisted(flusher->ticket());
+        } else {
             SFENCE();
         }
     }
 
+    // Bound the queue to maxItems items and to maxNodeBytes bytes of nodes (0 for unbounded).
+    // The bounds apply to tryEnq and enqWait only.
+    void setCapacity(uint64_t maxItems, size_t maxNodeBytes = 0) {
+        capacity.set(maxItems, maxNodeBytes);
+        // The count is not maintained while unbounded, so it is recomputed, with the queue quiescent
+        uint64_t count = 0;
+        for (Node* node = Head.load()->next.load(); node != nullptr; node = node->next.load()) {
+            count++;
+        }
+        itemCount.store(count);
+    }
+
+    // Returns false, without enqueuing, if the queue is at its capacity
+    bool tryEnq(T item, int threadId) {
+        if (!capacity.hasRoom(getSize(), sizeof(Node))) {
+            return false;
+        }
+        enq(item, threadId);
+        return true;
+    }
+
+    // Waits for a dequeue to make room if the queue is at its capacity
+    void enqWait(T item, int threadId) {
+        capacity.waitForRoom([&] { return capacity.hasRoom(getSize(), sizeof(Node)); });
+        enq(item, threadId);
+    }
+
+    void recover() {
+        Recovery recovery;
+        recoverBegin(recovery);
+
+        if (retireNonQueueNodes(recovery)) {
+            recovery.didFlush = true;
+        }
+
+        recoverEnd(recovery, recovery.queueNodes);
+    }
+
+    // Have recovery find the queue nodes by ranking the nodes of alloc's chunks on numThreads threads,
+    // instead of walking the next pointers from Head (1, the default)
+    void setRecoveryThreads(int numThreads) {
+        recoveryThreads = numThreads;
+    }
+
 private:
     std::atomic<Node*> Head DOUBLE_CACHE_LINE_ALIGNED;
     std::atomic<Node*> Tail DOUBLE_CACHE_LINE_ALIGNED;
+    Flusher* flusher;
+    uint32_t queueId;
+    Capacity capacity;
+    std::atomic<uint64_t> itemCount; // Volatile, maintained only while bounded, as nodes hold no index
+    int recoveryThreads;
 
     struct NodePtr {
         Node* ptr;
@@ -132,29 +205,106 @@ private:
         }
     }
 
-    void flushNotPersistedSuffix(Node* notPersisted) {
+    uint64_t getSize() {
+        return itemCount.load(ORDER_RELAXED);
+    }
+
+    void flushNotPersistedSuffix(Node* notPersisted, int threadId) {
         do {
-            FLUSH(notPersisted);
-            notPersisted = notPersisted->pred.load();
+            if (flusher) {
+                flusher->publish(notPersisted, threadId);
+            } else {
+                FLUSH(notPersisted);
+            }
+            notPersisted = notPersisted->pred.load(ORDER_RELAXED);
         } while (notPersisted != nullptr);
     }
 
-    bool getQueueNodesIncludingDummy(std::set<Node*>& queueNodes) {
+    /*
+    Recovery is split into phases, so that QueueRegistry can recover all the queues sharing alloc
+    with a single scan of its chunks:
+    recoverBegin, then isQueueNode or retireNonQueueNode on every node of the chunks, then recoverEnd.
+    */
+    typedef Node RecoveryNode;
+
+    struct Recovery {
+        std::vector<Node*> queueNodes; // In queue order, including the dummy node
+        NodeSlots<Node> slots;
+        std::vector<uint8_t> isQueueSlot;
+        Node* lastNode;
+        bool didFlush;
+    };
+
+    static uint32_t ownerOf(Node* node) {
+        return node->initialized;
+    }
+
+    void recoverBegin(Recovery& recovery) {
+        flusher = nullptr; // a flusher does not survive a crash
+        initializeNodeToPersistAndRetire();
+        recovery.slots.build(alloc);
+        if (recoveryThreads > 1 && recovery.slots.slotOf(Head.load()) != NO_SLOT) {
+            recovery.didFlush = getQueueNodesRanked(recovery);
+        } else {
+            recovery.didFlush = getQueueNodesIncludingDummy(recovery);
+        }
+
+        recovery.isQueueSlot.assign(recovery.slots.size(), 0);
+        for (Node* node : recovery.queueNodes) {
+            uint64_t slot = recovery.slots.slotOf(node);
+            if (slot != NO_SLOT) {
+                recovery.isQueueSlot[slot] = 1;
+            }
+        }
+    }
+
+    bool isQueueNode(const Recovery& recovery, Node* node) {
+        uint64_t slot = recovery.slots.slotOf(node);
+        return slot != NO_SLOT && recovery.isQueueSlot[slot];
+    }
+
+    // Returns whether a flush was issued
+    bool retireNonQueueNode(const Recovery& recovery, Node* node) {
+        return retireOrphanNode(node);
+    }
+
+    static bool retireOrphanNode(Node* node) {
+        if (node->initialized) {
+            node->initialized = 0;
+            FLUSH(node);
+            return true;
+        }
+        return false;
+    }
+
+    // The queue nodes were already found by following the next pointers from Head
+    void recoverEnd(Recovery& recovery, std::vector<Node*>& queueNodes) {
+        setPersistedSuffixAndRecoverTail(recovery.lastNode);
+        itemCount.store(queueNodes.size() - 1); // Not counting the dummy node
+
+        if (recovery.didFlush) {
+            SFENCE();
+        }
+    }
+
+    bool getQueueNodesIncludingDummy(Recovery& recovery) {
         Node* currNode = Head.load();
     
-        if (!currNode->initialized) {
-            currNode->initialize();
-            queueNodes.insert(currNode);
+        if (currNode->initialized != queueId) {
+            currNode->initialize(queueId);
+            recovery.queueNodes.push_back(currNode);
+            recovery.lastNode = currNode;
             return false;
         }
         
         while (true) {
-            queueNodes.insert(currNode);
+            recovery.queueNodes.push_back(currNode);
+            recovery.lastNode = currNode;
             Node* nextNode = currNode->next.load();
             if (nextNode == nullptr) {
                 return false;
             }
-            if (!nextNode->initialized) {
+            if (nextNode->initialized != queueId) {
                 currNode->next.store(nullptr, std::memory_order_relaxed);
                 FLUSH(currNode);
                 return true;
@@ -163,7 +313,89 @@ private:
         }
     }
 
-    bool retireNonQueueNodes(std::set<Node*>& queueNodes) {
+    /*
+    The parallel alternative of getQueueNodesIncludingDummy. Every node of alloc's chunks initialized for this queue
+    is linked to its next node, if that one was initialized for it too, and the resulting lists are ranked in parallel.
+    A node on the walk from Head ends its list where Head's does, at the position given by the difference of their ranks.
+    Nodes of other lists that merge into Head's at the same position, such as freed nodes that still point into it,
+    are told apart from Head on.
+    */
+    bool getQueueNodesRanked(Recovery& recovery) {
+        const NodeSlots<Node>& slots = recovery.slots;
+        uint64_t numSlots = slots.size();
+        Node* head = Head.load();
+
+        if (head->initialized != queueId) {
+            return getQueueNodesIncludingDummy(recovery);
+        }
+
+        std::vector<uint64_t> successor(numSlots);
+        forEachRange(recoveryThreads, numSlots, [&](uint64_t begin, uint64_t end) {
+            for (uint64_t i = begin; i < end; i++) {
+                successor[i] = i;
+                Node* node = slots.nodeAt(i);
+                Node* nextNode = node->next.load(std::memory_order_relaxed);
+                if (node->initialized != queueId || nextNode == nullptr) {
+                    continue;
+                }
+                uint64_t nextSlot = slots.slotOf(nextNode);
+                if (nextSlot != NO_SLOT && nextNode->initialized == queueId) {
+                    successor[i] = nextSlot;
+                }
+            }
+        });
+
+        std::vector<uint64_t> last, rank;
+        rankLists(successor, recoveryThreads, last, rank);
+
+        uint64_t headSlot = slots.slotOf(head);
+        if (successor[last[headSlot]] != last[headSlot]) {
+            return getQueueNodesIncludingDummy(recovery); // Head leads into a cycle, left to the walk as before
+        }
+        uint64_t size = rank[headSlot] + 1;
+        std::vector<std::atomic<uint64_t>> positions(size); // Slot + 1 of a node of each position, 0 for none yet
+        std::vector<uint64_t> contested; // Positions of more than one node
+        std::mutex contestedLock;
+        forEachRange(recoveryThreads, numSlots, [&](uint64_t begin, uint64_t end) {
+            std::vector<uint64_t> rangeConflicts;
+            for (uint64_t i = begin; i < end; i++) {
+                if (last[i] != last[headSlot] || rank[i] > rank[headSlot] || slots.nodeAt(i)->initialized != queueId) {
+                    continue;
+                }
+                uint64_t expected = 0;
+                uint64_t position = rank[headSlot] - rank[i];
+                if (!positions[position].compare_exchange_strong(expected, i + 1)) {
+                    rangeConflicts.push_back(position);
+                }
+            }
+            std::lock_guard<std::mutex> lock(contestedLock);
+            contested.insert(contested.end(), rangeConflicts.begin(), rangeConflicts.end());
+        });
+
+        recovery.queueNodes.resize(size);
+        forEachRange(recoveryThreads, size, [&](uint64_t begin, uint64_t end) {
+            for (uint64_t i = begin; i < end; i++) {
+                recovery.queueNodes[i] = slots.nodeAt(positions[i].load() - 1);
+            }
+        });
+
+        // The queue node of a contested position is the next of the queue node of the previous one
+        std::sort(contested.begin(), contested.end());
+        for (uint64_t position : contested) {
+            recovery.queueNodes[position] = (position == 0) ? head : recovery.queueNodes[position - 1]->next.load();
+        }
+
+        Node* lastNode = recovery.queueNodes[size - 1];
+        recovery.lastNode = lastNode;
+        if (lastNode->next.load() != nullptr) {
+            lastNode->next.store(nullptr, std::memory_order_relaxed);
+            FLUSH(lastNode);
+            return true;
+        }
+        return false;
+    }
+
+    bool retireNonQueueNodes(Recovery& recovery) {
         bool didFlush = false;
 
         for (auto curr = alloc->mem_chunks; curr != nullptr; curr = curr->next) {
@@ -171,12 +403,8 @@ private:
             uint64_t numOfNodes = SSMEM_DEFAULT_MEM_SIZE / sizeof(Node);
             for (uint64_t i = 0; i < numOfNodes; i++) {
                 Node* currNode = currChunk + i;
-                if (queueNodes.find(currNode) == queueNodes.end()) {
-                    if (currNode->initialized) {
-                        currNode->initialized = false;
-                        FLUSH(currNode);
-                        didFlush = true;
-                    }
+                if (!isQueueNode(recovery, currNode)) {
+                    didFlush |= retireNonQueueNode(recovery, currNode);
                     ssmem_free(alloc, currNode);
                 }
             }
@@ -4,9 +4,20 @@
 #define OPT_LINKED_Q_H_
 
 #include <atomic>
-#include <set>
+#include <vector>
+#include <string>
+#include <unordered_set>
+#include <algorithm>
+#include <functional>
+#include <mutex>
 
 #include <ssmem.h>
+#include <capacity.h>
+#include <purge.h>
+#include <materializer.h>
+#include <listrank.h>
+#include <backup.h>
+#include <replication.h>
 
 #include "utilities.h"
 
@@ -19,13 +30,26 @@ private:
         T item;
         PersistentNode* pred;
         uint64_t index;
+        uint32_t owner; // The id of the queue the node was allocated for
+        uint32_t checksum; // Over the fields above, written last
 
-        void initialize(T value) {
+        void initialize(T value, uint32_t queueId) {
             item = value;
+            owner = queueId;
         }
 
-        void initialize() {
-            initialize(T());
+        uint32_t computeChecksum() const {
+            uint64_t hash = CHECKSUM_SEED;
+            hash = checksumUpdate(hash, &item, sizeof(item));
+            hash = checksumUpdate(hash, &pred, sizeof(pred));
+            hash = checksumUpdate(hash, &index, sizeof(index));
+            hash = checksumUpdate(hash, &owner, sizeof(owner));
+            return checksumFinish(hash);
+        }
+
+        // A node whose lines were persisted only in part, or were not persisted since it was reused, fails this
+        bool isIntact() const {
+            return checksum == computeChecksum();
         }
     } __attribute__((aligned (32)));
 
@@ -37,15 +61,15 @@ private:
         uint64_t index;
         PersistentNode* persistentNode;
 
-        void initialize(T value) {
+        void initialize(T value, uint32_t queueId) {
             item = value;
             next.store(nullptr, std::memory_order_relaxed);
             persistentNode = static_cast<PersistentNode*>(ssmem_alloc(alloc, sizeof(PersistentNode)));
-            persistentNode->initialize(value);
+            persistentNode->initialize(value, queueId);
         }
 
-        void initialize() {
-            initialize(T());
+        void initialize(uint32_t queueId) {
+            initialize(T(), queueId);
         }
     } __attribute__((aligned (32)));
 
@@ -57,14 +81,21 @@ private:
         return static_cast<VolatileNode*>(volatileNode);
     }
 
+    template<class Q> friend class QueueRegistry;
+
 public:
-    OptLinkedQ() :
+    // Queues whose nodes share an allocator must have distinct ids, for telling their nodes apart in recovery
+    OptLinkedQ(uint32_t id = 1) :
         Head(allocVolatileNode()),
-        Tail(Head.load())
+        Tail(Head.load()),
+        queueId(id),
+        lazyRecovery(false),
+        recoveryThreads(1),
+        replication(nullptr)
     {
         VolatileNode* dummyNode = Head.load();
 
-        dummyNode->initialize();
+        dummyNode->initialize(queueId);
         dummyNode->pred.store(nullptr, std::memory_order_relaxed);
         // No need to persist the dummy node, recovery will anyhow not reach it
 
@@ -79,19 +110,29 @@ public:
     }
 
     bool deq(T* dequeuedItem, int threadId) {
+        if (!localData[threadId].purgedNodes.isEmpty()) {
+            reclaimPurged(threadId, PURGE_RECLAIM_BATCH);
+        }
+
         while (true) {
-            VolatileNode* head = Head.load();
-            VolatileNode* headNext = head->next.load();
+            VolatileNode* head = Head.load(ORDER_ACQUIRE);
+            VolatileNode* headNext = head->next.load(ORDER_ACQUIRE);
             if (headNext == nullptr) {
+                if (lazyRecovery && materializeAfter(head)) {
+                    continue;
+                }
                 __writeq(head->index, &(localData[threadId].headIndex));
                 SFENCE();
                 return false;
             }
            
-            if (Head.compare_exchange_strong(head, headNext)) {
+            if (Head.compare_exchange_strong(head, headNext, ORDER_ACQ_REL, ORDER_RELAXED)) {
                 *dequeuedItem = headNext->item;
                 __writeq(headNext->index, &(localData[threadId].headIndex));
                 SFENCE();
+                if (replication) {
+                    replication->publishHead(headNext->index);
+                }
 
                 headNext->pred.store(nullptr, std::memory_order_relaxed);
 
@@ -100,6 +141,8 @@ public:
                     ssmem_free(volatileAlloc, localData[threadId].nodeToRetire);
                 }
                 localData[threadId].nodeToRetire = head;
+
+                capacity.notifyDequeue();
                
                 return true;
             }
@@ -107,57 +150,225 @@ public:
     }
 
     void enq(T item, int threadId) {
+        if (!localData[threadId].purgedNodes.isEmpty()) {
+            reclaimPurged(threadId, PURGE_RECLAIM_BATCH);
+        }
+
         VolatileNode* newNode = allocVolatileNode();
-        newNode->initialize(item);
+        newNode->initialize(item, queueId);
         while (true) {
-            VolatileNode* tail = Tail.load();
-            VolatileNode* tailNext = tail->next.load();
+            VolatileNode* tail = Tail.load(ORDER_ACQUIRE);
+            VolatileNode* tailNext = tail->next.load(ORDER_ACQUIRE);
             if (tailNext == nullptr) {
                 newNode->pred.store(tail, std::memory_order_relaxed);
                 newNode->index = tail->index + 1;
                 newNode->persistentNode->pred = tail->persistentNode;
-                std::atomic_thread_fence(std::memory_order_release); // pred of newNode->persistentNode must be written before its index
                 newNode->persistentNode->index = newNode->index;
-                if (tail->next.compare_exchange_strong(tailNext, newNode)) {
-                    Tail.compare_exchange_strong(tail, newNode);
+                // Recovery validates the checksum, so the fields may be written and persisted in any order
+                newNode->persistentNode->checksum = newNode->persistentNode->computeChecksum();
+                if (tail->next.compare_exchange_strong(tailNext, newNode, ORDER_RELEASE, ORDER_RELAXED)) {
+                    Tail.compare_exchange_strong(tail, newNode, ORDER_RELEASE, ORDER_RELAXED);
                     flushNotPersistedSuffix(newNode);
                     recordLastEnqueue(newNode, threadId);
                     SFENCE();
+                    if (replication) {
+                        replication->publishItem(newNode->index, item);
+                    }
 
                     newNode->pred.store(nullptr, std::memory_order_relaxed);
                     break;
                 }
             }
-            Tail.compare_exchange_strong(tail, tailNext);
+            Tail.compare_exchange_strong(tail, tailNext, ORDER_RELEASE, ORDER_RELAXED);
         }
     }
 
-    void recover() {
-        initializeNodeToRetire();
+    // Remove the items up to index at once (all of them, if the queue holds no item of that index),
+    // persisting the new head index only once. Returns the head index after the purge.
+    // The removed nodes are freed lazily, by threadId's later operations or by reclaimPurged.
+    uint64_t purgeUntil(uint64_t index, int threadId) {
+        VolatileNode* target = Head.load(ORDER_ACQUIRE);
+        while (true) {
+            VolatileNode* head = Head.load(ORDER_ACQUIRE);
+            if (target->index <= head->index) {
+                target = head; // Dequeuers passed it
+            }
+            while (target->index < index) {
+                VolatileNode* targetNext = target->next.load(ORDER_ACQUIRE);
+                if (targetNext == nullptr) {
+                    if (lazyRecovery && materializeAfter(target)) {
+                        continue;
+                    }
+                    break;
+                }
+                target = targetNext;
+            }
+            if (target == head) {
+                return head->index;
+            }
 
-        uint64_t headIndex = getMaxLocalHeadIndex();
-        
-        std::set<LastEnqueue, decltype(lastEnqueueCmp)*> potentialTails(lastEnqueueCmp);
-        getPotentialTails(potentialTails, headIndex);
+            if (Head.compare_exchange_strong(head, target, ORDER_ACQ_REL, ORDER_RELAXED)) {
+                __writeq(target->index, &(localData[threadId].headIndex));
+                SFENCE();
+                if (replication) {
+                    replication->publishHead(target->index);
+                }
+
+                target->pred.store(nullptr, std::memory_order_relaxed);
+
+                localData[threadId].purgedNodes.add(head, target);
+                capacity.notifyDequeue();
+
+                return target->index;
+            }
+        }
+    }
+
+    // Free up to maxNodes of the nodes threadId purged, e.g. all of them while the thread is idle
+    void reclaimPurged(int threadId, uint64_t maxNodes = UINT64_MAX) {
+        localData[threadId].purgedNodes.reclaim(maxNodes, [](VolatileNode* node) {
+            ssmem_free(alloc, node->persistentNode);
+            ssmem_free(volatileAlloc, node);
+        });
+    }
+
+    // Have recover() materialize only the recovered tail, and dequeuers materialize the other recovered items
+    // LAZY_RECOVERY_SEGMENT at a time as Head reaches them, instead of recover() materializing all of them
+    void setLazyRecovery(bool lazy) {
+        lazyRecovery = lazy;
+    }
+
+    // Have recovery find the queue nodes by ranking the nodes of alloc's chunks on numThreads threads,
+    // instead of walking the pred pointers from the tail (1, the default)
+    void setRecoveryThreads(int numThreads) {
+        recoveryThreads = numThreads;
+    }
+
+    /*
+    Create the shared-memory ring ringName, and publish to it every enqueued item and head advance once persisted,
+    for a Standby in another process to keep a replica of the queue. The replica holds the items enqueued from now on.
+    Call while no operation runs. Returns false if the ring could not be created.
+    */
+    bool startReplication(const char* ringName, uint64_t capacity) {
+        replication = ReplicationRing<T>::create(ringName, capacity, Tail.load()->index);
+        return replication != nullptr;
+    }
 
-        std::set<PersistentNode*> queueNodes; // Not including the new dummy PersistentNode we will later allocate
-        getQueueNodes(potentialTails, queueNodes, headIndex);
+    // Call while no operation runs; the ring's name is left for the standby to unlink
+    void stopReplication() {
+        if (replication) {
+            ReplicationRing<T>::detach(replication);
+            replication = nullptr;
+        }
+    }
+
+    // Bound the queue to maxItems items and to maxNodeBytes bytes of nodes (0 for unbounded).
+    // The bounds apply to tryEnq and enqWait only.
+    void setCapacity(uint64_t maxItems, size_t maxNodeBytes = 0) {
+        capacity.set(maxItems, maxNodeBytes);
+    }
+
+    // Returns false, without enqueuing, if the queue is at its capacity
+    bool tryEnq(T item, int threadId) {
+        if (!capacity.hasRoom(getSize(), sizeof(PersistentNode))) {
+            return false;
+        }
+        enq(item, threadId);
+        return true;
+    }
+
+    // Waits for a dequeue to make room if the queue is at its capacity
+    void enqWait(T item, int threadId) {
+        capacity.waitForRoom([&] { return capacity.hasRoom(getSize(), sizeof(PersistentNode)); });
+        enq(item, threadId);
+    }
+
+    void recover() {
+        Recovery recovery;
+        recoverBegin(recovery);
         
-        retireNonQueueNodes(queueNodes, headIndex); // retiring alloc's nodes; volatileAlloc is assumed to be reset
+        retireNonQueueNodes(recovery); // retiring alloc's nodes; volatileAlloc is assumed to be reset
 
         // We allocate a new dummy PersistentNode only after retiring non-queue PersistenNode objects, for preventing retiring the dummy node
-        recoverHead(headIndex);
+        recoverEnd(recovery, recovery.queueNodes);
+    }
 
-        recoverVolatileQueue(queueNodes);
+    /*
+    Write the items with an index above lastIndex to a new backup file at path, with the current head index,
+    while enqueuers and dequeuers go on. On success, lastIndex is advanced to the largest index written,
+    for the next, incremental, backup (start a chain with a full one, from 0).
+    The calling thread must have initialized its allocators and must not free nodes meanwhile:
+    its ssmem timestamp then stays unchanged, which keeps the nodes dequeued during the backup from being reused
+    before they are copied. Items enqueued meanwhile are left to the next backup.
+    */
+    bool backup(const char* path, uint64_t& lastIndex) {
+        BackupWriter<T> writer;
+        if (!writer.open(path)) {
+            return false;
+        }
 
-        recoverLastEnqueues();
-       
-        SFENCE();
+        VolatileNode* node = Head.load(ORDER_ACQUIRE);
+        uint64_t headIndex = node->index;
+        uint64_t backedUpIndex = std::max(lastIndex, headIndex);
+        while (true) {
+            VolatileNode* next = node->next.load(ORDER_ACQUIRE);
+            if (next == nullptr) {
+                if (lazyRecovery && materializeAfter(node)) {
+                    continue;
+                }
+                break;
+            }
+            node = next;
+            if (node->index > lastIndex) {
+                writer.add(node->index, 0, node->item);
+                backedUpIndex = node->index;
+            }
+        }
+
+        if (!writer.close(headIndex, backedUpIndex)) {
+            return false;
+        }
+        lastIndex = backedUpIndex;
+        return true;
+    }
+
+    // Enqueue the items of a backup chain, given from its full backup on, with a single fence.
+    // Not concurrent with other operations. The items are renumbered after the current tail.
+    bool restore(const std::vector<std::string>& paths, int threadId) {
+        std::vector<BackupRecord<T>> records;
+        if (!readBackupChain(paths, records)) {
+            return false;
+        }
+        bulkEnq(records, threadId);
+        return true;
+    }
+
+    /*
+    Recover the items like recover(), but hand them to callback(items, numItems) in FIFO order, batchSize at a time,
+    instead of rebuilding them as volatile nodes. After each batch the head index past it is persisted
+    and its nodes are freed, so a crash while draining recovers the items of the later batches only
+    (and of the batch the callback was handling). The queue is left empty.
+    */
+    template<class F> void recoverInto(F callback, size_t batchSize) {
+        Recovery recovery;
+        recoverBegin(recovery);
+
+        retireNonQueueNodes(recovery); // retiring alloc's nodes; volatileAlloc is assumed to be reset
+
+        drainQueueNodes(recovery, callback, batchSize);
+
+        recoverEnd(recovery, recovery.queueNodes);
     }
 
 private:
     std::atomic<VolatileNode*> Head DOUBLE_CACHE_LINE_ALIGNED;
     std::atomic<VolatileNode*> Tail DOUBLE_CACHE_LINE_ALIGNED;
+    uint32_t queueId;
+    Capacity capacity;
+    bool lazyRecovery;
+    int recoveryThreads;
+    ReplicationRing<T>* replication;
+    LazyMaterializer<VolatileNode, PersistentNode> materializer; // Volatile
 
     struct LastEnqueue {
         PersistentNode* ptr;
@@ -170,17 +381,18 @@ private:
         int lastEnqueuesIndex;
         LastEnqueue lastEnqueues[2] CACHE_LINE_ALIGNED;
         uint64_t headIndex;
+        PurgedNodes<VolatileNode> purgedNodes; // Volatile
     } DOUBLE_CACHE_LINE_ALIGNED;
 
     LocalData localData[MAX_THREADS];
 
     void flushNotPersistedSuffix(VolatileNode* notPersisted) {
         while (true) {
-            VolatileNode* pred = notPersisted->pred.load();
+            VolatileNode* pred = notPersisted->pred.load(ORDER_RELAXED);
             if (pred == nullptr) {
                 break;
             }
-            FLUSH(notPersisted->persistentNode);
+            FLUSH_RANGE(notPersisted->persistentNode, sizeof(PersistentNode));
             notPersisted = pred;
         }
     }
@@ -213,6 +425,7 @@ private:
     void initializeNodeToRetire() {
         for (int i = 0; i < MAX_THREADS; i++) {
             localData[i].nodeToRetire = nullptr;
+            localData[i].purgedNodes.clear();
         }
     }
 
@@ -225,6 +438,10 @@ private:
         localData[threadId].lastEnqueuesIndex = 0;
     }
         
+    uint64_t getSize() {
+        return Tail.load(ORDER_ACQUIRE)->index - Head.load(ORDER_ACQUIRE)->index;
+    }
+
     uint64_t getMaxLocalHeadIndex() {
         uint64_t headIndex = 0;
         for (int i = 0; i < MAX_THREADS; i++) {
@@ -236,10 +453,11 @@ private:
     }
 
     static bool lastEnqueueCmp(const LastEnqueue& potentialTail1, const LastEnqueue& potentialTail2) {
-        return potentialTail1.index < potentialTail2.index; 
+        return potentialTail1.index > potentialTail2.index;
     }
-        
-    void getPotentialTails(std::set<LastEnqueue, decltype(lastEnqueueCmp)*>& potentialTails, 
+
+    // In descending index order. Records of equal indices are all kept, as only one of them may point to a queue node.
+    void getPotentialTails(std::vector<LastEnqueue>& potentialTails,
         uint64_t headIndex) {
         for (int i = 0; i < MAX_THREADS; i++) {
             for (int j = 0; j < 2; j++) {
@@ -253,63 +471,286 @@ private:
                 if ((potentialTail.index <= headIndex) || !potentialTail.ptr) {
                     continue;
                 }
-                potentialTails.insert(potentialTail); // Add this valid potential tail
+                potentialTails.push_back(potentialTail); // Add this valid potential tail
             }
         }
+        std::stable_sort(potentialTails.begin(), potentialTails.end(), lastEnqueueCmp);
     }
 
+    /*
+    The walk down a pred chain from a node is the same whichever potential tail it started from,
+    so a walk that reaches a node of a chain that failed fails as well, and stops there.
+    Thus each node is walked at most once over all the potential tails.
+    On success, queueNodes holds the chain in index order.
+    */
     bool getQueueNodesIfTail(const LastEnqueue& potentialTail,
-        std::set<PersistentNode*>& queueNodes, 
+        std::vector<PersistentNode*>& queueNodes,
+        std::unordered_set<PersistentNode*>& failedNodes,
         uint64_t headIndex) {
-        if (potentialTail.ptr->index != potentialTail.index) {
+        if (potentialTail.ptr->index != potentialTail.index || potentialTail.ptr->owner != queueId ||
+            !potentialTail.ptr->isIntact()) {
             return false;
         }
 
         PersistentNode* currNode = potentialTail.ptr;
-        while (true) {
-            queueNodes.insert(currNode);
+        while (failedNodes.find(currNode) == failedNodes.end()) {
+            queueNodes.push_back(currNode);
             if (currNode->index == headIndex + 1) {
+                std::reverse(queueNodes.begin(), queueNodes.end());
                 return true;
             }
             PersistentNode* predNode = currNode->pred;
-            if (predNode->index != currNode->index - 1) {
-                queueNodes.clear();
-                return false;
+            if (predNode->index != currNode->index - 1 || predNode->owner != queueId || !predNode->isIntact()) {
+                break;
             }
             currNode = predNode;
         }
+        failedNodes.insert(queueNodes.begin(), queueNodes.end());
+        queueNodes.clear();
+        return false;
     }
- 
+
     void getQueueNodes(
-        const std::set<LastEnqueue, decltype(lastEnqueueCmp)*>& potentialTails,
-        std::set<PersistentNode*>& queueNodes,
+        const std::vector<LastEnqueue>& potentialTails,
+        std::vector<PersistentNode*>& queueNodes,
         uint64_t headIndex) {
-        for (auto reversedIterator = potentialTails.rbegin(); 
-            reversedIterator != potentialTails.rend();
-            reversedIterator++) {
-            if (getQueueNodesIfTail(*reversedIterator, queueNodes, headIndex)) {
+        std::unordered_set<PersistentNode*> failedNodes;
+        for (const LastEnqueue& potentialTail : potentialTails) {
+            if (getQueueNodesIfTail(potentialTail, queueNodes, failedNodes, headIndex)) {
                 break;
             }
         }
     }
 
-    void retireNonQueueNodes(const std::set<PersistentNode*>& queueNodes, uint64_t headIndex) {
+    /*
+    The parallel alternative of getQueueNodes. Every node of alloc's chunks that may be a queue node is linked to its pred
+    if the pred may be the queue node of the previous index, and the resulting lists are ranked in parallel.
+    A node is on a chain that reaches headIndex + 1 if the last node of its list has that index,
+    so each potential tail is checked in O(1), and the nodes of the chosen chain are placed by their index.
+    Nodes of other chains that claim the same index are told apart from the tail down.
+    */
+    void getQueueNodesRanked(
+        const std::vector<LastEnqueue>& potentialTails,
+        std::vector<PersistentNode*>& queueNodes,
+        uint64_t headIndex) {
+        NodeSlots<PersistentNode> slots;
+        slots.build(alloc);
+        uint64_t numSlots = slots.size();
+
+        std::vector<uint8_t> isCandidate(numSlots);
+        forEachRange(recoveryThreads, numSlots, [&](uint64_t begin, uint64_t end) {
+            for (uint64_t i = begin; i < end; i++) {
+                PersistentNode* node = slots.nodeAt(i);
+                isCandidate[i] = node->owner == queueId && node->index > headIndex && node->isIntact();
+            }
+        });
+
+        std::vector<uint64_t> successor(numSlots);
+        forEachRange(recoveryThreads, numSlots, [&](uint64_t begin, uint64_t end) {
+            for (uint64_t i = begin; i < end; i++) {
+                successor[i] = i;
+                PersistentNode* node = slots.nodeAt(i);
+                if (!isCandidate[i] || node->index == headIndex + 1) {
+                    continue;
+                }
+                uint64_t predSlot = slots.slotOf(node->pred);
+                if (predSlot != NO_SLOT && isCandidate[predSlot] && slots.nodeAt(predSlot)->index == node->index - 1) {
+                    successor[i] = predSlot;
+                }
+            }
+        });
+
+        std::vector<uint64_t> last, rank;
+        rankLists(successor, recoveryThreads, last, rank);
+        auto reachesHead = [&](uint64_t slot) {
+            return isCandidate[slot] && slots.nodeAt(last[slot])->index == headIndex + 1;
+        };
+
+        PersistentNode* tail = nullptr;
+        for (const LastEnqueue& potentialTail : potentialTails) {
+            uint64_t slot = slots.slotOf(potentialTail.ptr);
+            if (slot != NO_SLOT && potentialTail.ptr->index == potentialTail.index && reachesHead(slot)) {
+                tail = potentialTail.ptr;
+                break;
+            }
+        }
+        if (tail == nullptr) {
+            return;
+        }
+
+        uint64_t size = tail->index - headIndex;
+        std::vector<std::atomic<uint64_t>> positions(size); // Slot + 1 of a node of each index, 0 for none yet
+        std::vector<uint64_t> contested; // Indices of more than one node, relative to headIndex + 1
+        std::mutex contestedLock;
+        forEachRange(recoveryThreads, numSlots, [&](uint64_t begin, uint64_t end) {
+            std::vector<uint64_t> rangeConflicts;
+            for (uint64_t i = begin; i < end; i++) {
+                if (!reachesHead(i) || slots.nodeAt(i)->index > tail->index) {
+                    continue;
+                }
+                uint64_t expected = 0;
+                uint64_t position = slots.nodeAt(i)->index - headIndex - 1;
+                if (!positions[position].compare_exchange_strong(expected, i + 1)) {
+                    rangeConflicts.push_back(position);
+                }
+            }
+            std::lock_guard<std::mutex> lock(contestedLock);
+            contested.insert(contested.end(), rangeConflicts.begin(), rangeConflicts.end());
+        });
+
+        queueNodes.resize(size);
+        forEachRange(recoveryThreads, size, [&](uint64_t begin, uint64_t end) {
+            for (uint64_t i = begin; i < end; i++) {
+                queueNodes[i] = slots.nodeAt(positions[i].load() - 1);
+            }
+        });
+
+        // The queue node of a contested index is the pred of the queue node of the next one
+        std::sort(contested.begin(), contested.end(), std::greater<uint64_t>());
+        for (uint64_t position : contested) {
+            queueNodes[position] = (position == size - 1) ? tail : queueNodes[position + 1]->pred;
+        }
+    }
+
+    /*
+    Recovery is split into phases, so that QueueRegistry can recover all the queues sharing alloc
+    with a single scan of its chunks:
+    recoverBegin, then isQueueNode or retireNonQueueNode on every node of the chunks, then recoverEnd.
+    */
+    typedef PersistentNode RecoveryNode;
+
+    struct Recovery {
+        uint64_t headIndex;
+        std::vector<PersistentNode*> queueNodes; // In index order, not including the new dummy PersistentNode we will later allocate
+    };
+
+    static uint32_t ownerOf(PersistentNode* node) {
+        return node->owner;
+    }
+
+    void recoverBegin(Recovery& recovery) {
+        initializeNodeToRetire();
+
+        recovery.headIndex = getMaxLocalHeadIndex();
+
+        std::vector<LastEnqueue> potentialTails;
+        getPotentialTails(potentialTails, recovery.headIndex);
+
+        if (recoveryThreads > 1) {
+            getQueueNodesRanked(potentialTails, recovery.queueNodes, recovery.headIndex);
+        } else {
+            getQueueNodes(potentialTails, recovery.queueNodes, recovery.headIndex);
+        }
+    }
+
+    // The queue node of each index is at its position in the chain, so no lookup structure is needed
+    bool isQueueNode(const Recovery& recovery, PersistentNode* node) {
+        uint64_t index = node->index;
+        return index > recovery.headIndex && index - recovery.headIndex - 1 < recovery.queueNodes.size() &&
+            recovery.queueNodes[index - recovery.headIndex - 1] == node;
+    }
+
+    // Returns whether a flush was issued
+    bool retireNonQueueNode(const Recovery& recovery, PersistentNode* node) {
+        if (node->index > recovery.headIndex) {
+            node->index = 0;
+            FLUSH(&node->index);
+            return true;
+        }
+        return false;
+    }
+
+    // Without the head index of its queue, any index is cleared
+    static bool retireOrphanNode(PersistentNode* node) {
+        if (node->index != 0) {
+            node->index = 0;
+            FLUSH(&node->index);
+            return true;
+        }
+        return false;
+    }
+
+    // The queue nodes were already found, in index order, by following the pred pointers from the tail,
+    // so the ones collected by the scan are not needed
+    void recoverEnd(Recovery& recovery, std::vector<PersistentNode*>& queueNodes) {
+        recoverHead(recovery.headIndex);
+
+        recoverVolatileQueue(recovery.queueNodes);
+
+        recoverLastEnqueues();
+
+        SFENCE();
+    }
+
+    void retireNonQueueNodes(Recovery& recovery) {
         for (auto curr = alloc->mem_chunks; curr != nullptr; curr = curr->next) {
             PersistentNode* currChunk = static_cast<PersistentNode*>(curr->obj);
             uint64_t numOfNodes = SSMEM_DEFAULT_MEM_SIZE / sizeof(PersistentNode);
             for (uint64_t i = 0; i < numOfNodes; i++) {
                 PersistentNode* currNode = currChunk + i;
-                if (queueNodes.find(currNode) == queueNodes.end()) {
-                    if (currNode->index > headIndex) {
-                        currNode->index = 0;
-                        FLUSH(currNode);
-                    }
+                if (!isQueueNode(recovery, currNode)) {
+                    retireNonQueueNode(recovery, currNode);
                     ssmem_free(alloc, currNode);
                 }
             }
         }
     }
 
+    // The nodes are persisted with a single fence, which also persists threadId's last enqueue of the new tail
+    void bulkEnq(const std::vector<BackupRecord<T>>& records, int threadId) {
+        if (records.empty()) {
+            return;
+        }
+        VolatileNode* tail = Tail.load(ORDER_ACQUIRE);
+        VolatileNode* first = nullptr;
+        for (const BackupRecord<T>& record : records) {
+            VolatileNode* newNode = allocVolatileNode();
+            newNode->initialize(record.item, queueId);
+            if (first == nullptr) {
+                first = newNode;
+            }
+            newNode->pred.store(nullptr, ORDER_RELAXED);
+            newNode->index = tail->index + 1;
+            newNode->persistentNode->pred = tail->persistentNode;
+            newNode->persistentNode->index = newNode->index;
+            newNode->persistentNode->checksum = newNode->persistentNode->computeChecksum();
+            FLUSH_RANGE(newNode->persistentNode, sizeof(PersistentNode));
+            tail->next.store(newNode, ORDER_RELAXED);
+            tail = newNode;
+        }
+        recordLastEnqueue(tail, threadId);
+        SFENCE();
+        Tail.store(tail, ORDER_RELEASE);
+
+        if (replication) {
+            for (VolatileNode* node = first; node != nullptr; node = node->next.load(ORDER_RELAXED)) {
+                replication->publishItem(node->index, node->item);
+            }
+        }
+    }
+
+    template<class F> void drainQueueNodes(Recovery& recovery, F callback, size_t batchSize) {
+        std::vector<T> items;
+        items.reserve(batchSize);
+        for (size_t begin = 0; begin < recovery.queueNodes.size(); begin += batchSize) {
+            size_t end = std::min(begin + batchSize, recovery.queueNodes.size());
+            items.clear();
+            for (size_t i = begin; i < end; i++) {
+                items.push_back(recovery.queueNodes[i]->item);
+            }
+            callback(items.data(), items.size());
+
+            // Recovery takes the maximal head index of the threads, so any thread's cell does
+            recovery.headIndex = recovery.queueNodes[end - 1]->index;
+            __writeq(recovery.headIndex, &(localData[0].headIndex));
+            SFENCE();
+            for (size_t i = begin; i < end; i++) {
+                ssmem_free(alloc, recovery.queueNodes[i]);
+            }
+        }
+        recovery.queueNodes.clear();
+    }
+
     void recoverHead(uint64_t headIndex) {
         VolatileNode* head = allocVolatileNode();
         head->persistentNode = static_cast<PersistentNode*>(ssmem_alloc(alloc, sizeof(PersistentNode)));
@@ -323,7 +764,34 @@ private:
         Tail.store(volatileTail);
     }
     
-    void recoverVolatileQueue(const std::set<PersistentNode*>& queueNodes) {
+    VolatileNode* materialize(PersistentNode* persistentNode) {
+        VolatileNode* volatileNode = allocVolatileNode();
+        volatileNode->next.store(nullptr, ORDER_RELAXED);
+        volatileNode->pred.store(nullptr, ORDER_RELAXED);
+        volatileNode->item = persistentNode->item;
+        volatileNode->index = persistentNode->index;
+        volatileNode->persistentNode = persistentNode;
+        return volatileNode;
+    }
+
+    bool materializeAfter(VolatileNode* node) {
+        return materializer.materializeAfter(node, [this](PersistentNode* persistentNode) {
+            return materialize(persistentNode);
+        });
+    }
+
+    void recoverVolatileQueue(std::vector<PersistentNode*>& queueNodes) {
+        materializer.reset();
+
+        if (lazyRecovery && queueNodes.size() > LAZY_RECOVERY_SEGMENT) {
+            VolatileNode* volatileTail = materialize(queueNodes.back());
+            queueNodes.pop_back();
+            Head.load()->next.store(nullptr);
+            materializer.start(Head.load(), std::move(queueNodes), volatileTail);
+            setPersistedSuffixAndRecoverTail(volatileTail);
+            return;
+        }
+
         VolatileNode* volatileTail = nullptr;
         VolatileNode* subsequentVolatileNode = nullptr;
 
@@ -4,9 +4,17 @@
 #define OPT_UNLINKED_Q_H_
 
 #include <atomic>
-#include <set>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <time.h>
 
 #include <ssmem.h>
+#include <flusher.h>
+#include <capacity.h>
+#include <purge.h>
+#include <materializer.h>
+#include <backup.h>
 
 #include "utilities.h"
 
@@ -16,18 +24,34 @@ private:
     public:
         T item;
         uint64_t index;
-        bool linked;
+        uint32_t linked; // The id of the queue the node is linked into, 0 until it is linked and once its item is cancelled
+        uint32_t checksum; // Over the other fields, written last
+        uint64_t expiresAt; // CLOCK_REALTIME nanoseconds after which the item is skipped, 0 if it never expires
 
-        void initialize(T value) {
+        // Recovery validates the checksum, so a reused node may keep its old index and linked
+        // until its new ones are written, and its fields may be persisted in any order
+        void initialize(T value, uint64_t expiry) {
             item = value;
-            linked = false;
+            expiresAt = expiry;
+            linked = 0;
+        }
+
+        uint32_t computeChecksum() const {
+            uint64_t hash = CHECKSUM_SEED;
+            hash = checksumUpdate(hash, &item, sizeof(item));
+            hash = checksumUpdate(hash, &index, sizeof(index));
+            hash = checksumUpdate(hash, &linked, sizeof(linked));
+            hash = checksumUpdate(hash, &expiresAt, sizeof(expiresAt));
+            return checksumFinish(hash);
+        }
 
-            // verify linked is set to false before index is later increased
-            std::atomic_thread_fence(std::memory_order_release);
+        // A node whose lines were persisted only in part, or were not persisted since it was reused, fails this
+        bool isIntact() const {
+            return checksum == computeChecksum();
         }
 
         void initialize() {
-            initialize(T());
+            initialize(T(), 0);
         }
     } __attribute__((aligned (32)));
 
@@ -37,28 +61,53 @@ private:
         uint64_t index;
         std::atomic<VolatileNode*> next;
         PersistentNode* persistentNode;
+        uint64_t expiresAt;
+        std::atomic<uint64_t> claim; // index while the item is pending, then Dequeued or Cancelled by whoever took it
+        uint64_t generation; // Advanced whenever the node is allocated, so that a handle to its previous use fails
 
-        void initialize(T value) {
+        void initialize(T value, uint64_t expiry) {
             item = value;
-            next = nullptr;
+            expiresAt = expiry;
+            next.store(nullptr, ORDER_RELAXED);
             persistentNode = static_cast<PersistentNode*>(ssmem_alloc(alloc, sizeof(PersistentNode)));
-            persistentNode->initialize(value);
+            persistentNode->initialize(value, expiry);
         }
 
         void initialize() {
-            initialize(T());
+            initialize(T(), 0);
         }
     } __attribute__((aligned (32)));
 
     VolatileNode* allocVolatileNode() {
-        void* volatileNode = ssmem_alloc(volatileAlloc, sizeof(VolatileNode));
-        return static_cast<VolatileNode*>(volatileNode);
+        VolatileNode* volatileNode = static_cast<VolatileNode*>(ssmem_alloc(volatileAlloc, sizeof(VolatileNode)));
+        volatileNode->generation++;
+        return volatileNode;
     }
 
+    static const uint64_t Dequeued = UINT64_MAX;
+    static const uint64_t Cancelled = UINT64_MAX - 1;
+
+    template<class Q> friend class QueueRegistry;
+    template<class U> friend class CohortQ;
+
 public:
-    OptUnlinkedQ() :
+    // Identifies an enqueued item of a queue for cancel, until the queue is recovered
+    struct Handle {
+        uint64_t index;
+        VolatileNode* node;
+        uint64_t generation;
+        uint32_t queueId;
+    };
+
+    // Queues whose nodes share an allocator must have distinct ids, for telling their nodes apart in recovery
+    OptUnlinkedQ(uint32_t id = 1) :
         Head(allocVolatileNode()),
-        Tail(Head.load())
+        Tail(Head.load()),
+        flusher(nullptr),
+        queueId(id),
+        hasExpiringItems(false),
+        hasCancelledItems(false),
+        lazyRecovery(false)
     {
         Head.load()->initialize();
         Head.load()->index = 0;
@@ -73,73 +122,333 @@ public:
     }
 
     bool deq(T* dequeuedItem, int threadId) {
+        if (!localData[threadId].purgedNodes.isEmpty()) {
+            reclaimPurged(threadId, PURGE_RECLAIM_BATCH);
+        }
+
+        uint64_t now = hasExpiringItems.load(ORDER_RELAXED) ? currentTime() : 0;
+        bool skip = now || hasCancelledItems.load(ORDER_RELAXED);
+
         while (true) {
-            VolatileNode* head = Head.load();
-            VolatileNode* headNext = head->next.load();
+            VolatileNode* head = Head.load(ORDER_ACQUIRE);
+            VolatileNode* headNext = head->next.load(ORDER_ACQUIRE);
             if (headNext == nullptr) {
+                if (lazyRecovery && materializeAfter(head)) {
+                    continue;
+                }
                 __writeq(head->index, &(localData[threadId].headIndex));
                 SFENCE();
                 return false;
             }
 
-            if (Head.compare_exchange_strong(head, headNext)) {
-                *dequeuedItem = headNext->item;
-                __writeq(headNext->index, &(localData[threadId].headIndex));
+            // Head skips a run of expired and cancelled items in one advance, to the first live item or to the last item
+            VolatileNode* newHead = skip ? skipDead(headNext, now) : headNext;
+
+            if (Head.compare_exchange_strong(head, newHead, ORDER_ACQ_REL, ORDER_RELAXED)) {
+                __writeq(newHead->index, &(localData[threadId].headIndex));
                 SFENCE();
 
-                if (localData[threadId].nodeToRetire) { // It equals NULL in the first successful deq
-                    ssmem_free(alloc, localData[threadId].nodeToRetire->persistentNode);
-                    ssmem_free(volatileAlloc, localData[threadId].nodeToRetire);
+                uint64_t claim = newHead->claim.exchange(Dequeued, ORDER_ACQ_REL);
+                if (newHead != headNext) {
+                    settleClaims(headNext, newHead);
+                    localData[threadId].purgedNodes.add(head, newHead); // Freed like purged nodes, without reading their items
+                } else {
+                    if (localData[threadId].nodeToRetire) { // It equals NULL in the first successful deq
+                        ssmem_free(alloc, localData[threadId].nodeToRetire->persistentNode);
+                        ssmem_free(volatileAlloc, localData[threadId].nodeToRetire);
+                    }
+                    localData[threadId].nodeToRetire = head;
                 }
-                localData[threadId].nodeToRetire = head;
+
+                capacity.notifyDequeue();
+
+                if (isExpired(newHead, now)) {
+                    return false; // All the items were expired
+                }
+                if (claim == Cancelled) {
+                    continue; // Cancelled since it was read, or the last item and cancelled
+                }
+                *dequeuedItem = newHead->item;
                 
                 return true;
             }
         }
     }
 
-    void enq(T item, int threadId) {
+    // The item deq would return next, without dequeuing it; it is exact while no other thread dequeues
+    bool peek(T* item) {
+        uint64_t now = hasExpiringItems.load(ORDER_RELAXED) ? currentTime() : 0;
+        bool skip = now || hasCancelledItems.load(ORDER_RELAXED);
+
+        while (true) {
+            VolatileNode* head = Head.load(ORDER_ACQUIRE);
+            VolatileNode* headNext = head->next.load(ORDER_ACQUIRE);
+            if (headNext == nullptr) {
+                if (lazyRecovery && materializeAfter(head)) {
+                    continue;
+                }
+                return false;
+            }
+            VolatileNode* node = skip ? skipDead(headNext, now) : headNext;
+            if (isDead(node, now)) {
+                return false;
+            }
+            *item = node->item;
+            return true;
+        }
+    }
+
+    // Items with a non-zero expiresAt (CLOCK_REALTIME nanoseconds) are skipped by deq once it passed
+    Handle enq(T item, int threadId, uint64_t expiresAt = 0) {
+        if (!localData[threadId].purgedNodes.isEmpty()) {
+            reclaimPurged(threadId, PURGE_RECLAIM_BATCH);
+        }
+        if (expiresAt != 0 && !hasExpiringItems.load(ORDER_RELAXED)) {
+            hasExpiringItems.store(true, ORDER_RELAXED);
+        }
+
         VolatileNode* newNode = allocVolatileNode();
-        newNode->initialize(item);
+        newNode->initialize(item, expiresAt);
 
         while (true) {
-            VolatileNode* tail = Tail.load();
-            VolatileNode* tailNext = tail->next.load();
+            VolatileNode* tail = Tail.load(ORDER_ACQUIRE);
+            VolatileNode* tailNext = tail->next.load(ORDER_ACQUIRE);
             if (tailNext == nullptr) {
                 newNode->persistentNode->index = tail->index + 1;
                 newNode->index = newNode->persistentNode->index;
-                if (tail->next.compare_exchange_strong(tailNext, newNode)) {
-                    newNode->persistentNode->linked = true;
-                    FLUSH(newNode->persistentNode);
-                    Tail.compare_exchange_strong(tail, newNode);
+                newNode->claim.store(newNode->index, ORDER_RELAXED);
+                if (tail->next.compare_exchange_strong(tailNext, newNode, ORDER_RELEASE, ORDER_RELAXED)) {
+                    PersistentNode* persistentNode = newNode->persistentNode;
+                    persistentNode->linked = queueId;
+                    persistentNode->checksum = persistentNode->computeChecksum();
+                    if (flusher) {
+                        uintptr_t line = (uintptr_t)persistentNode & ~(uintptr_t)(CACHE_LINE_SIZE - 1);
+                        for (; line < (uintptr_t)(persistentNode + 1); line += CACHE_LINE_SIZE) {
+                            flusher->publish((void*)line, threadId);
+                        }
+                    } else {
+                        FLUSH_RANGE(persistentNode, sizeof(PersistentNode));
+                        ISSUE_FLUSHES();
+                    }
+                    Tail.compare_exchange_strong(tail, newNode, ORDER_RELEASE, ORDER_RELAXED);
+                    return Handle{newNode->index, newNode, newNode->generation, queueId};
+                }
+            }
+            Tail.compare_exchange_strong(tail, tailNext, ORDER_RELEASE, ORDER_RELAXED);
+        }
+    }
+
+    /*
+    Remove the item of handle from the queue, if no dequeuer took it yet, in O(1): the node is claimed
+    and its persistent node unlinked (a tombstone), with one flush and fence. deq skips cancelled items
+    like expired ones, and recovery retires their nodes. Returns false if the item left the queue first,
+    by a dequeue, a purge or a skip of expired items, or if handle is of another queue.
+    The calling thread must have initialized its allocators, which keeps the node from being reused meanwhile.
+    */
+    bool cancel(Handle handle, int threadId) {
+        if (handle.queueId != queueId || handle.node->generation != handle.generation) {
+            return false; // The node was freed and reused meanwhile
+        }
+        uint64_t index = handle.index;
+        if (!handle.node->claim.compare_exchange_strong(index, Cancelled, ORDER_ACQ_REL, ORDER_RELAXED)) {
+            return false;
+        }
+        if (!hasCancelledItems.load(ORDER_RELAXED)) {
+            hasCancelledItems.store(true, ORDER_RELAXED);
+        }
+        PersistentNode* persistentNode = handle.node->persistentNode;
+        persistentNode->linked = 0;
+        FLUSH(&persistentNode->linked);
+        SFENCE();
+        return true;
+    }
+
+    // Remove the items up to index at once (all of them, if the queue holds no item of that index),
+    // persisting the new head index only once. Returns the head index after the purge.
+    // The removed nodes are freed lazily, by threadId's later operations or by reclaimPurged.
+    uint64_t purgeUntil(uint64_t index, int threadId) {
+        VolatileNode* target = Head.load(ORDER_ACQUIRE);
+        while (true) {
+            VolatileNode* head = Head.load(ORDER_ACQUIRE);
+            if (target->index <= head->index) {
+                target = head; // Dequeuers passed it
+            }
+            while (target->index < index) {
+                VolatileNode* targetNext = target->next.load(ORDER_ACQUIRE);
+                if (targetNext == nullptr) {
+                    if (lazyRecovery && materializeAfter(target)) {
+                        continue;
+                    }
                     break;
                 }
+                target = targetNext;
+            }
+            if (target == head) {
+                return head->index;
+            }
+
+            if (Head.compare_exchange_strong(head, target, ORDER_ACQ_REL, ORDER_RELAXED)) {
+                __writeq(target->index, &(localData[threadId].headIndex));
+                SFENCE();
+
+                settleClaims(head->next.load(ORDER_ACQUIRE), target);
+                localData[threadId].purgedNodes.add(head, target);
+                capacity.notifyDequeue();
+
+                return target->index;
             }
-            Tail.compare_exchange_strong(tail, tailNext);
         }
     }
 
+    // Free up to maxNodes of the nodes threadId purged, e.g. all of them while the thread is idle
+    void reclaimPurged(int threadId, uint64_t maxNodes = UINT64_MAX) {
+        localData[threadId].purgedNodes.reclaim(maxNodes, [](VolatileNode* node) {
+            ssmem_free(alloc, node->persistentNode);
+            ssmem_free(volatileAlloc, node);
+        });
+    }
+
+    // Enqueue an item that deq skips once ttl nanoseconds passed
+    Handle enqWithTtl(T item, uint64_t ttl, int threadId) {
+        return enq(item, threadId, currentTime() + ttl);
+    }
+
+    // Have recover() materialize only the recovered tail, and dequeuers materialize the other recovered items
+    // LAZY_RECOVERY_SEGMENT at a time as Head reaches them, instead of recover() materializing all of them
+    void setLazyRecovery(bool lazy) {
+        lazyRecovery = lazy;
+    }
+
+    // Delegate the write-back of enqueued nodes to a flusher thread; nullptr restores in-line flushing
+    void setFlusher(Flusher* f) {
+        flusher = f;
+    }
+
+    // Wait until the nodes enqueued so far are persisted (without a flusher, the ones the calling thread enqueued)
+    void sync() {
+        if (flusher) {
+            flusher->waitPersisted(flusher->ticket());
+        } else {
+            SFENCE();
+        }
+    }
+
+    // Bound the queue to maxItems items and to maxNodeBytes bytes of nodes (0 for unbounded).
+    // The bounds apply to tryEnq and enqWait only.
+    void setCapacity(uint64_t maxItems, size_t maxNodeBytes = 0) {
+        capacity.set(maxItems, maxNodeBytes);
+    }
+
+    // Returns false, without enqueuing, if the queue is at its capacity
+    bool tryEnq(T item, int threadId) {
+        if (!capacity.hasRoom(getSize(), sizeof(PersistentNode))) {
+            return false;
+        }
+        enq(item, threadId);
+        return true;
+    }
+
+    // Waits for a dequeue to make room if the queue is at its capacity
+    void enqWait(T item, int threadId) {
+        capacity.waitForRoom([&] { return capacity.hasRoom(getSize(), sizeof(PersistentNode)); });
+        enq(item, threadId);
+    }
+
     void recover() {
-        initializeNodeToRetire();
+        Recovery recovery;
+        recoverBegin(recovery);
         
-        uint64_t headIndex = getMaxLocalHeadIndex();
-        
-        std::set<PersistentNode*, decltype(nodeCmp)*> queueNodes(nodeCmp); // Not including the new dummy PersistentNode we will later allocate
-        getQueueNodesAndRetireOthers(headIndex, queueNodes); // retiring alloc's nodes; volatileAlloc is assumed to be reset
+        std::vector<PersistentNode*> queueNodes; // Not including the new dummy PersistentNode we will later allocate
+        getQueueNodesAndRetireOthers(recovery, queueNodes); // retiring alloc's nodes; volatileAlloc is assumed to be reset
         
         // We allocate a new dummy PersistentNode only after retiring non-queue PersistenNode objects, for preventing retiring the dummy node
-        recoverHead(headIndex);
+        recoverEnd(recovery, queueNodes);
+    }
 
-        recoverVolatileQueue(queueNodes);
+    /*
+    Write the items with an index above lastIndex to a new backup file at path, with the current head index,
+    while enqueuers and dequeuers go on. On success, lastIndex is advanced to the largest index written,
+    for the next, incremental, backup (start a chain with a full one, from 0).
+    The calling thread must have initialized its allocators and must not free nodes meanwhile:
+    its ssmem timestamp then stays unchanged, which keeps the nodes dequeued during the backup from being reused
+    before they are copied. Items enqueued meanwhile are left to the next backup.
+    */
+    bool backup(const char* path, uint64_t& lastIndex) {
+        BackupWriter<T> writer;
+        if (!writer.open(path)) {
+            return false;
+        }
+
+        VolatileNode* node = Head.load(ORDER_ACQUIRE);
+        uint64_t headIndex = node->index;
+        uint64_t backedUpIndex = std::max(lastIndex, headIndex);
+        while (true) {
+            VolatileNode* next = node->next.load(ORDER_ACQUIRE);
+            if (next == nullptr) {
+                if (lazyRecovery && materializeAfter(node)) {
+                    continue;
+                }
+                break;
+            }
+            node = next;
+            if (node->index > lastIndex && node->claim.load(ORDER_ACQUIRE) != Cancelled) {
+                writer.add(node->index, node->expiresAt, node->item);
+                backedUpIndex = node->index;
+            }
+        }
+
+        if (!writer.close(headIndex, backedUpIndex)) {
+            return false;
+        }
+        lastIndex = backedUpIndex;
+        return true;
+    }
+
+    // Enqueue the items of a backup chain, given from its full backup on, with a single fence.
+    // Not concurrent with other operations. The items are renumbered after the current tail.
+    bool restore(const std::vector<std::string>& paths, int threadId) {
+        std::vector<BackupRecord<T>> records;
+        if (!readBackupChain(paths, records)) {
+            return false;
+        }
+        bulkEnq(records, threadId);
+        return true;
+    }
+
+    /*
+    Recover the items like recover(), but hand them to callback(items, numItems) in FIFO order, batchSize at a time,
+    instead of rebuilding them as volatile nodes. Expired items are left out. After each batch the head index
+    past it is persisted and its nodes are freed, so a crash while draining recovers the items of the later batches only
+    (and of the batch the callback was handling). The queue is left empty.
+    */
+    template<class F> void recoverInto(F callback, size_t batchSize) {
+        Recovery recovery;
+        recoverBegin(recovery);
+
+        std::vector<PersistentNode*> queueNodes;
+        getQueueNodesAndRetireOthers(recovery, queueNodes); // retiring alloc's nodes; volatileAlloc is assumed to be reset
+        std::sort(queueNodes.begin(), queueNodes.end(), nodeCmp);
+
+        drainQueueNodes(recovery, queueNodes, callback, batchSize);
+
+        recoverEnd(recovery, queueNodes);
     }
 
 private:
     std::atomic<VolatileNode*> Head DOUBLE_CACHE_LINE_ALIGNED;
     std::atomic<VolatileNode*> Tail DOUBLE_CACHE_LINE_ALIGNED;
+    Flusher* flusher;
+    uint32_t queueId;
+    Capacity capacity;
+    std::atomic<bool> hasExpiringItems; // Volatile, spares deq reading the clock until an item may expire
+    std::atomic<bool> hasCancelledItems; // Volatile, spares deq looking for a run to skip until an item is cancelled
+    bool lazyRecovery;
+    LazyMaterializer<VolatileNode, PersistentNode> materializer; // Volatile
     
     struct LocalData {
         VolatileNode* nodeToRetire CACHE_LINE_ALIGNED;
         uint64_t headIndex CACHE_LINE_ALIGNED;
+        PurgedNodes<VolatileNode> purgedNodes; // Volatile
     } DOUBLE_CACHE_LINE_ALIGNED;
 
     LocalData localData[MAX_THREADS];
@@ -147,7 +456,47 @@ private:
     void initializeNodeToRetire() {
         for (int i = 0; i < MAX_THREADS; i++) {
             localData[i].nodeToRetire = nullptr;
+            localData[i].purgedNodes.clear();
+        }
+    }
+
+    static uint64_t currentTime() {
+        struct timespec time;
+        clock_gettime(CLOCK_REALTIME, &time);
+        return (uint64_t)time.tv_sec * 1000000000UL + time.tv_nsec;
+    }
+
+    static bool isExpired(VolatileNode* node, uint64_t now) {
+        return node->expiresAt != 0 && node->expiresAt <= now;
+    }
+
+    static bool isDead(VolatileNode* node, uint64_t now) {
+        return isExpired(node, now) || node->claim.load(ORDER_ACQUIRE) == Cancelled;
+    }
+
+    // The nodes from first up to last left the queue without a dequeue of their items; cancel must fail on them
+    static void settleClaims(VolatileNode* first, VolatileNode* last) {
+        for (VolatileNode* node = first; ; node = node->next.load(ORDER_ACQUIRE)) {
+            node->claim.store(Dequeued, ORDER_RELEASE);
+            if (node == last) {
+                break;
+            }
+        }
+    }
+
+    static VolatileNode* skipDead(VolatileNode* node, uint64_t now) {
+        while (isDead(node, now)) {
+            VolatileNode* next = node->next.load(ORDER_ACQUIRE);
+            if (next == nullptr) {
+                break;
+            }
+            node = next;
         }
+        return node;
+    }
+
+    uint64_t getSize() {
+        return Tail.load(ORDER_ACQUIRE)->index - Head.load(ORDER_ACQUIRE)->index;
     }
 
     uint64_t getMaxLocalHeadIndex() {
@@ -164,23 +513,117 @@ private:
         return node1->index < node2->index; 
     }
 
-    void getQueueNodesAndRetireOthers(uint64_t headIndex, 
-        std::set<PersistentNode*, decltype(nodeCmp)*>& queueNodes) {        
+    /*
+    Recovery is split into phases, so that QueueRegistry can recover all the queues sharing alloc
+    with a single scan of its chunks:
+    recoverBegin, then isQueueNode or retireNonQueueNode on every node of the chunks, then recoverEnd.
+    */
+    typedef PersistentNode RecoveryNode;
+
+    struct Recovery {
+        uint64_t headIndex;
+    };
+
+    static uint32_t ownerOf(PersistentNode* node) {
+        return node->linked;
+    }
+
+    void recoverBegin(Recovery& recovery) {
+        flusher = nullptr; // a flusher does not survive a crash
+        initializeNodeToRetire();
+        recovery.headIndex = getMaxLocalHeadIndex();
+    }
+
+    bool isQueueNode(const Recovery& recovery, PersistentNode* node) {
+        return node->linked == queueId && node->index > recovery.headIndex && node->isIntact();
+    }
+
+    // Returns whether a flush was issued. Nothing to clear: initialize() resets linked before a node is reused.
+    bool retireNonQueueNode(const Recovery& recovery, PersistentNode* node) {
+        return false;
+    }
+
+    static bool retireOrphanNode(PersistentNode* node) {
+        return false;
+    }
+
+    void recoverEnd(Recovery& recovery, std::vector<PersistentNode*>& queueNodes) {
+        std::sort(queueNodes.begin(), queueNodes.end(), nodeCmp);
+
+        recoverHead(recovery.headIndex);
+
+        recoverVolatileQueue(queueNodes);
+    }
+
+    void getQueueNodesAndRetireOthers(Recovery& recovery,
+        std::vector<PersistentNode*>& queueNodes) {
         for (auto curr = alloc->mem_chunks; curr != nullptr; curr = curr->next) {
             PersistentNode* currChunk = static_cast<PersistentNode*>(curr->obj);
             uint64_t numOfNodes = SSMEM_DEFAULT_MEM_SIZE / sizeof(PersistentNode);
             for (uint64_t i = 0; i < numOfNodes; i++) {
                 PersistentNode* currNode = currChunk + i;
-                if (currNode->linked && currNode->index > headIndex) {
-                    queueNodes.insert(currNode);
+                if (isQueueNode(recovery, currNode)) {
+                    queueNodes.push_back(currNode);
                 }
                 else {
+                    retireNonQueueNode(recovery, currNode);
                     ssmem_free(alloc, currNode);
                 }
             }
         }
     }
 
+    // The nodes are persisted with a single fence
+    void bulkEnq(const std::vector<BackupRecord<T>>& records, int threadId) {
+        VolatileNode* tail = Tail.load(ORDER_ACQUIRE);
+        for (const BackupRecord<T>& record : records) {
+            if (record.expiresAt != 0) {
+                hasExpiringItems.store(true, ORDER_RELAXED);
+            }
+            VolatileNode* newNode = allocVolatileNode();
+            newNode->initialize(record.item, record.expiresAt);
+            newNode->index = tail->index + 1;
+            newNode->claim.store(newNode->index, ORDER_RELAXED);
+            PersistentNode* persistentNode = newNode->persistentNode;
+            persistentNode->index = newNode->index;
+            persistentNode->linked = queueId;
+            persistentNode->checksum = persistentNode->computeChecksum();
+            FLUSH_RANGE(persistentNode, sizeof(PersistentNode));
+            tail->next.store(newNode, ORDER_RELAXED);
+            tail = newNode;
+        }
+        SFENCE();
+        Tail.store(tail, ORDER_RELEASE);
+    }
+
+    template<class F> void drainQueueNodes(Recovery& recovery, std::vector<PersistentNode*>& queueNodes,
+        F callback, size_t batchSize) {
+        uint64_t now = currentTime();
+        std::vector<T> items;
+        items.reserve(batchSize);
+        for (size_t begin = 0; begin < queueNodes.size(); begin += batchSize) {
+            size_t end = std::min(begin + batchSize, queueNodes.size());
+            items.clear();
+            for (size_t i = begin; i < end; i++) {
+                if (queueNodes[i]->expiresAt == 0 || queueNodes[i]->expiresAt > now) {
+                    items.push_back(queueNodes[i]->item);
+                }
+            }
+            if (!items.empty()) {
+                callback(items.data(), items.size());
+            }
+
+            // Recovery takes the maximal head index of the threads, so any thread's cell does
+            recovery.headIndex = queueNodes[end - 1]->index;
+            __writeq(recovery.headIndex, &(localData[0].headIndex));
+            SFENCE();
+            for (size_t i = begin; i < end; i++) {
+                ssmem_free(alloc, queueNodes[i]);
+            }
+        }
+        queueNodes.clear();
+    }
+
     void recoverHead(uint64_t headIndex) {
         VolatileNode* head = allocVolatileNode();
         head->persistentNode = static_cast<PersistentNode*>(ssmem_alloc(alloc, sizeof(PersistentNode)));
@@ -189,19 +632,45 @@ private:
         Head.store(head);
     }
 
-    void recoverVolatileQueue(std::set<PersistentNode*, decltype(nodeCmp)*>& queueNodes) {
+    VolatileNode* materialize(PersistentNode* persistentNode) {
+        VolatileNode* node = allocVolatileNode();
+        node->next.store(nullptr, ORDER_RELAXED);
+        node->item = persistentNode->item;
+        node->index = persistentNode->index;
+        node->persistentNode = persistentNode;
+        node->expiresAt = persistentNode->expiresAt;
+        node->claim.store(node->index, ORDER_RELAXED);
+        if (node->expiresAt != 0) {
+            hasExpiringItems.store(true, ORDER_RELAXED);
+        }
+        return node;
+    }
+
+    bool materializeAfter(VolatileNode* node) {
+        return materializer.materializeAfter(node, [this](PersistentNode* persistentNode) {
+            return materialize(persistentNode);
+        });
+    }
+
+    void recoverVolatileQueue(std::vector<PersistentNode*>& queueNodes) {
+        materializer.reset();
+        Head.load()->next.store(nullptr);
+
+        if (lazyRecovery && queueNodes.size() > LAZY_RECOVERY_SEGMENT) {
+            VolatileNode* lastNode = materialize(queueNodes.back());
+            queueNodes.pop_back();
+            materializer.start(Head.load(), std::move(queueNodes), lastNode);
+            Tail.store(lastNode);
+            return;
+        }
+
         VolatileNode* predNode = Head.load();
         for (auto persistentNode : queueNodes) {
-            VolatileNode* node = allocVolatileNode();
+            VolatileNode* node = materialize(persistentNode);
             predNode->next.store(node);
-            node->item = persistentNode->item;
-            node->index = persistentNode->index;
-            node->persistentNode = persistentNode;
-
             predNode = node;
         }
         VolatileNode* lastNode = predNode;
-        lastNode->next.store(nullptr);
 
         Tail.store(lastNode);
     }
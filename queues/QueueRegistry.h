@@ -0,0 +1,322 @@
+#pragma once
+
+#ifndef QUEUE_REGISTRY_H_
+#define QUEUE_REGISTRY_H_
+
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <ssmem.h>
+
+#include "utilities.h"
+
+#define QUEUE_NAME_SIZE     64   /* including the terminating null character */
+#define QUEUE_REGISTRY_SIZE 1024 /* queues a registry can hold */
+#define QUEUE_ID_TAG_SHIFT  16   /* the low bits of a queue id hold its entry index + 1, the high bits its registry's tag */
+
+/*
+Volatile bookkeeping shared by the registries of all queue types: the tags in use, and the registry each allocator serves.
+*/
+class RegistryTags {
+public:
+    // A tag no registry of this process uses, nor any recovered one
+    static uint32_t next() {
+        std::lock_guard<std::mutex> lock(mutex());
+        uint32_t tag = nextTag()++;
+        assert(tag < (1u << (32 - QUEUE_ID_TAG_SHIFT))); // Out of tags
+        return tag;
+    }
+
+    // The tag of a recovered registry, which the registries created from now on must not reuse
+    static void markUsed(uint32_t tag) {
+        std::lock_guard<std::mutex> lock(mutex());
+        if (nextTag() <= tag) {
+            nextTag() = tag + 1;
+        }
+    }
+
+    // Binds allocator to the registry of tag. Recovery retires whatever it does not own in the chunks it scans,
+    // so an allocator must serve a single registry.
+    static void claim(ssmem_allocator_t* allocator, uint32_t tag) {
+        std::lock_guard<std::mutex> lock(mutex());
+        auto claimed = owners().insert(std::make_pair(allocator, tag)).first;
+        assert(claimed->second == tag); // The allocator serves another registry
+        (void)claimed;
+    }
+
+    static void release(uint32_t tag) {
+        std::lock_guard<std::mutex> lock(mutex());
+        for (auto it = owners().begin(); it != owners().end();) {
+            it = it->second == tag ? owners().erase(it) : std::next(it);
+        }
+    }
+
+private:
+    static std::mutex& mutex() {
+        static std::mutex registryTagsLock;
+        return registryTagsLock;
+    }
+
+    static uint32_t& nextTag() {
+        static uint32_t tag = 1;
+        return tag;
+    }
+
+    static std::map<ssmem_allocator_t*, uint32_t>& owners() {
+        static std::map<ssmem_allocator_t*, uint32_t> allocatorOwners;
+        return allocatorOwners;
+    }
+};
+
+/*
+A persistent directory of named queues of type Q (any of LinkedQ, UnlinkedQ, OptLinkedQ, OptUnlinkedQ, TimestampedQ, TreiberStack, SkiplistPQ, Bag).
+Each queue gets a distinct id, the registry's tag and its entry index + 1, with which its nodes are tagged.
+This lets recoverAll recover all the queues with one scan of alloc's chunks,
+instead of each queue scanning them, and retiring the nodes of all the others, in turn.
+The scan retires every node of the chunks that none of the registry's queues owns, and reads the chunks
+as arrays of one node type, so the allocators of the threads that use the registry's queues must serve
+that registry only: no other registry, whether of another queue type or embedded in a CohortQ or GroupedQ,
+and no queue created outside a registry. The allocators of the threads that open queues or recover
+are claimed for the registry, and a node of another registry or of a standalone queue fails recovery.
+*/
+template<class Q> class QueueRegistry {
+private:
+    typedef typename Q::RecoveryNode Node;
+    typedef typename Q::Recovery Recovery;
+
+public:
+    QueueRegistry() :
+        tag(RegistryTags::next())
+    {
+        static_assert(QUEUE_REGISTRY_SIZE < (1 << QUEUE_ID_TAG_SHIFT), "entry indices must fit in the low bits of a queue id");
+        FLUSH(&tag);
+        for (int i = 0; i < QUEUE_REGISTRY_SIZE; i++) {
+            entries[i].queue = nullptr;
+            entries[i].name[0] = '\0';
+            FLUSH(entries[i].name);
+            FLUSH(&entries[i].queue);
+        }
+        SFENCE();
+    }
+
+    ~QueueRegistry() {
+        for (int i = 0; i < QUEUE_REGISTRY_SIZE; i++) {
+            if (entries[i].queue) {
+                destroyQueue(entries[i].queue);
+            }
+        }
+        RegistryTags::release(tag);
+    }
+
+    Q* openOrCreate(const char* name) {
+        assert(strlen(name) < QUEUE_NAME_SIZE);
+        RegistryTags::claim(alloc, tag);
+        std::lock_guard<std::mutex> lock(registryLock);
+
+        int freeEntry = -1;
+        for (int i = 0; i < QUEUE_REGISTRY_SIZE; i++) {
+            if (entries[i].queue == nullptr) {
+                if (freeEntry == -1) {
+                    freeEntry = i;
+                }
+            } else if (strncmp(entries[i].name, name, QUEUE_NAME_SIZE) == 0) {
+                return entries[i].queue;
+            }
+        }
+        assert(freeEntry != -1); // The registry is full
+
+        Q* queue = createQueue(idOf(freeEntry)); // The constructor persists the queue
+        strncpy(entries[freeEntry].name, name, QUEUE_NAME_SIZE);
+        FLUSH(entries[freeEntry].name);
+        SFENCE();
+        // The queue pointer is what makes the entry valid, so it is persisted only after the name
+        entries[freeEntry].queue = queue;
+        FLUSH(&entries[freeEntry].queue);
+        SFENCE();
+
+        return queue;
+    }
+
+    /*
+    Recover all the registered queues. Each queue first follows its own persistent pointers, if it has any,
+    then one scan of alloc's chunks assigns every node to the queue it belongs to or retires it,
+    and finally each queue rebuilds itself. numThreads threads split the work, the calling thread being
+    worker 0; the first two phases read the calling thread's alloc. The last phase allocates, so it is split
+    only if threadInit is given: it runs on each other worker, with its worker id, before anything else,
+    e.g. for initializing its alloc and volatileAlloc, like Executor's threadInit. Otherwise it runs on the calling thread.
+    */
+    void recoverAll(int numThreads, std::function<void(int)> threadInit = nullptr) {
+        RegistryTags::markUsed(tag);
+        RegistryTags::claim(alloc, tag);
+
+        std::vector<Recovery> recoveries(QUEUE_REGISTRY_SIZE);
+        ssmem_allocator_t* recoveredAlloc = alloc;
+
+        std::vector<ssmem_list_t*> chunks;
+        for (auto curr = alloc->mem_chunks; curr != nullptr; curr = curr->next) {
+            chunks.push_back(curr);
+        }
+
+        std::vector<std::vector<std::vector<Node*>>> queueNodes(numThreads,
+            std::vector<std::vector<Node*>>(QUEUE_REGISTRY_SIZE));
+        std::vector<std::vector<Node*>> nonQueueNodes(numThreads);
+
+        auto recoverBegins = [&](int workerId) {
+            ssmem_allocator_t* ownAlloc = alloc;
+            alloc = recoveredAlloc; // The chunks a queue's recoverBegin scans, if it scans them
+            for (int i = workerId; i < QUEUE_REGISTRY_SIZE; i += numThreads) {
+                if (entries[i].queue) {
+                    entries[i].queue->recoverBegin(recoveries[i]);
+                }
+            }
+            alloc = ownAlloc;
+        };
+
+        auto scanChunks = [&](int workerId) {
+            bool didFlush = false;
+            for (size_t c = workerId; c < chunks.size(); c += numThreads) {
+                Node* currChunk = static_cast<Node*>(chunks[c]->obj);
+                uint64_t numOfNodes = SSMEM_DEFAULT_MEM_SIZE / sizeof(Node);
+                for (uint64_t i = 0; i < numOfNodes; i++) {
+                    Node* currNode = currChunk + i;
+                    uint32_t owner = Q::ownerOf(currNode);
+                    // A node of another registry or of a standalone queue, which this recovery would destroy
+                    assert(owner == 0 || owner >> QUEUE_ID_TAG_SHIFT == tag);
+                    int entry = owner >> QUEUE_ID_TAG_SHIFT == tag ? (int)(owner & ((1u << QUEUE_ID_TAG_SHIFT) - 1)) - 1 : -1;
+                    Q* queue = (entry >= 0 && entry < QUEUE_REGISTRY_SIZE) ? entries[entry].queue : nullptr;
+                    if (queue && queue->isQueueNode(recoveries[entry], currNode)) {
+                        queueNodes[workerId][entry].push_back(currNode);
+                        continue;
+                    }
+                    if (queue) {
+                        didFlush |= queue->retireNonQueueNode(recoveries[entry], currNode);
+                    } else {
+                        didFlush |= Q::retireOrphanNode(currNode);
+                    }
+                    nonQueueNodes[workerId].push_back(currNode);
+                }
+            }
+            if (didFlush) {
+                SFENCE();
+            }
+        };
+
+        // Retired nodes go back to the allocator whose chunks were scanned
+        auto freeNonQueueNodes = [&](int workerId) {
+            if (workerId != 0) {
+                return;
+            }
+            for (int w = 0; w < numThreads; w++) {
+                for (auto node : nonQueueNodes[w]) {
+                    ssmem_free(alloc, node);
+                }
+            }
+        };
+
+        // Recovered queues allocate only after the non-queue nodes were retired, for preventing retiring their new nodes
+        auto recoverEnds = [&](int workerId) {
+            int numRecoveringThreads = threadInit ? numThreads : 1;
+            if (workerId >= numRecoveringThreads) {
+                return;
+            }
+            for (int i = workerId; i < QUEUE_REGISTRY_SIZE; i += numRecoveringThreads) {
+                if (!entries[i].queue) {
+                    continue;
+                }
+                std::vector<Node*> nodes;
+                for (int w = 0; w < numThreads; w++) {
+                    nodes.insert(nodes.end(), queueNodes[w][i].begin(), queueNodes[w][i].end());
+                }
+                entries[i].queue->recoverEnd(recoveries[i], nodes);
+            }
+        };
+
+        std::vector<std::function<void(int)>> phases = {recoverBegins, scanChunks, freeNonQueueNodes, recoverEnds};
+        runPhases(numThreads, phases, [&](int workerId) {
+            if (threadInit) {
+                threadInit(workerId);
+                RegistryTags::claim(alloc, tag);
+            }
+        });
+    }
+
+private:
+    struct Entry {
+        char name[QUEUE_NAME_SIZE] CACHE_LINE_ALIGNED;
+        Q* queue CACHE_LINE_ALIGNED;
+    };
+
+    uint32_t tag;
+    Entry entries[QUEUE_REGISTRY_SIZE];
+
+    static std::mutex registryLock; // Volatile, guards creation only
+
+    // The queues are over-aligned, which operator new does not honor before C++17
+    static Q* createQueue(uint32_t id) {
+        void* memory = nullptr;
+        int error = posix_memalign(&memory, alignof(Q), sizeof(Q));
+        assert(error == 0);
+        (void)error;
+        return new (memory) Q(id);
+    }
+
+    static void destroyQueue(Q* queue) {
+        queue->~Q();
+        free(queue);
+    }
+
+    uint32_t idOf(int entry) {
+        return (tag << QUEUE_ID_TAG_SHIFT) | (entry + 1);
+    }
+
+    // Each phase runs on all the workers, and starts only once every worker finished the previous one
+    static void runPhases(int numThreads, const std::vector<std::function<void(int)>>& phases,
+                          std::function<void(int)> workerInit) {
+        std::mutex barrierLock;
+        std::condition_variable barrierCondition;
+        int arrived = 0;
+        int round = 0;
+        auto awaitOthers = [&]() {
+            std::unique_lock<std::mutex> lock(barrierLock);
+            int myRound = round;
+            if (++arrived == numThreads) {
+                arrived = 0;
+                round++;
+                barrierCondition.notify_all();
+            } else {
+                barrierCondition.wait(lock, [&]() { return round != myRound; });
+            }
+        };
+        auto runWorker = [&](int workerId) {
+            for (auto& phase : phases) {
+                phase(workerId);
+                awaitOthers();
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (int w = 1; w < numThreads; w++) {
+            workers.push_back(std::thread([&, w]() {
+                workerInit(w);
+                runWorker(w);
+            }));
+        }
+        runWorker(0);
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+};
+
+template<class Q> std::mutex QueueRegistry<Q>::registryLock;
+
+#endif /* QUEUE_REGISTRY_H_ */
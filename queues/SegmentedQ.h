@@ -0,0 +1,733 @@
+#pragma once
+
+#ifndef SEGMENTED_Q_H_
+#define SEGMENTED_Q_H_
+
+#include <atomic>
+#include <vector>
+#include <mutex>
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <ssmem.h>
+#include <purge.h>
+
+#include "utilities.h"
+
+#define SEGMENT_SIZE           4096  /* consecutive indices covered by one segment */
+#define SEGMENT_DIRECTORY_SIZE 65536 /* segments that can be live at once, bounding the queue
+                                        length to SEGMENT_SIZE * SEGMENT_DIRECTORY_SIZE items */
+#define SEGMENT_SPILL_HOT_SEGMENTS 2 /* segments next to Head, and next to the newest one, that are never spilled;
+                                        spilled ones are read back once Head comes this close */
+
+/*
+OptUnlinkedQ with index-ordered allocation of the persistent nodes.
+Instead of coming from the threads' allocators, the persistent node of index i is slot i % SEGMENT_SIZE
+of the queue's segment number i / SEGMENT_SIZE, so consecutive items are laid out contiguously.
+A slot is known only once the node's index is, so the enqueuer that linked the node writes its slot.
+Segments are registered in a persistent directory, released as a whole once Head passes their last index,
+and they are the only memory recovery scans.
+With a spill file set, once the resident segments exceed a pmem budget, complete segments in the cold middle
+of the queue are moved to the file and their directory entries refer to it instead. Their volatile nodes are
+replaced by a single spill marker, so a spilled range holds no memory on either side. Once Head comes within
+SEGMENT_SPILL_HOT_SEGMENTS segments of a spilled one, the dequeuer that crosses into a new segment reads it back
+and rebuilds its volatile nodes after the marker, and a dequeuer that reaches a marker first reads it back itself.
+If that read fails, deq returns false, as if the queue ended there, and the next deq tries again.
+Recovery reads back only the spilled segments Head or Tail lies in, and the others get markers again.
+*/
+template<class T> class SegmentedQ {
+private:
+    class PersistentNode {
+    public:
+        T item;
+        uint64_t index;
+        bool linked;
+    } __attribute__((aligned (32)));
+
+    struct Segment {
+        uint64_t number;
+        std::atomic<uint64_t> written; // Slots written so far, volatile (recomputed by recovery)
+        PersistentNode nodes[SEGMENT_SIZE] CACHE_LINE_ALIGNED; // Also makes sizeof(Segment) a multiple of the line size
+    };
+
+    enum NodeKind : uint8_t {
+        ITEM_NODE,
+        SPILL_MARKER,  // Stands for a spilled segment, whose nodes are not in the list
+        LOADED_MARKER  // The nodes of its segment, read back, follow it; passed over like a dummy
+    };
+
+    class VolatileNode {
+    public:
+        T item;
+        uint64_t index; // For a marker, the index before its segment's first one
+        std::atomic<VolatileNode*> next; // Its low bit is set while a spill replaces the nodes after this one
+        std::atomic<uint8_t> kind;
+
+        void initialize(T value) {
+            item = value;
+            next.store(nullptr, ORDER_RELAXED);
+            kind.store(ITEM_NODE, ORDER_RELAXED);
+        }
+
+        void initialize() {
+            initialize(T());
+        }
+    } __attribute__((aligned (32)));
+
+    VolatileNode* allocVolatileNode() {
+        void* volatileNode = ssmem_alloc(volatileAlloc, sizeof(VolatileNode));
+        return static_cast<VolatileNode*>(volatileNode);
+    }
+
+public:
+    SegmentedQ() :
+        Head(allocVolatileNode()),
+        Tail(Head.load()),
+        spillFd(-1),
+        spillBudget(0),
+        residentSegments(0),
+        purgesInProgress(0)
+    {
+        Head.load()->initialize();
+        Head.load()->index = 0;
+
+        initializeNodeToRetire();
+
+        for (int i = 0; i < SEGMENT_DIRECTORY_SIZE; i++) {
+            segments[i].store(nullptr, std::memory_order_relaxed);
+            segmentPreds[i].store(nullptr, std::memory_order_relaxed);
+        }
+        segmentPreds[0].store(Head.load(), std::memory_order_relaxed);
+        for (int i = 0; i < SEGMENT_DIRECTORY_SIZE; i += CACHE_LINE_SIZE / sizeof(Segment*)) {
+            FLUSH(&segments[i]);
+        }
+        for (int i = 0; i < MAX_THREADS; i++) {
+            __writeq(0, &(localData[i].headIndex));
+        }
+        SFENCE();
+    }
+
+    bool deq(T* dequeuedItem, int threadId) {
+        if (!localData[threadId].purgedNodes.isEmpty()) {
+            reclaimPurged(threadId, PURGE_RECLAIM_BATCH);
+        }
+
+        while (true) {
+            VolatileNode* head = Head.load(ORDER_ACQUIRE);
+            VolatileNode* headNext = nextOf(head);
+            if (headNext == nullptr) {
+                __writeq(head->index, &(localData[threadId].headIndex));
+                SFENCE();
+                return false;
+            }
+
+            uint8_t kind = headNext->kind.load(ORDER_ACQUIRE);
+            if (kind == SPILL_MARKER && !loadSpilledSegment(markedSegment(headNext))) {
+                return false; // The spill file could not be read; Head stays before the marker
+            }
+
+            if (Head.compare_exchange_strong(head, headNext, ORDER_ACQ_REL, ORDER_RELAXED)) {
+                if (kind == ITEM_NODE) {
+                    *dequeuedItem = headNext->item;
+                    __writeq(headNext->index, &(localData[threadId].headIndex));
+                    SFENCE();
+                }
+
+                retirePassedSegments(head->index, headNext->index);
+                if (spillFd >= 0 && headNext->index / SEGMENT_SIZE != head->index / SEGMENT_SIZE) {
+                    prefetchSpilledSegments(headNext->index / SEGMENT_SIZE);
+                }
+
+                if (localData[threadId].nodeToRetire) { // It equals NULL in the first successful deq
+                    ssmem_free(volatileAlloc, localData[threadId].nodeToRetire);
+                }
+                localData[threadId].nodeToRetire = head;
+
+                if (kind == ITEM_NODE) {
+                    return true;
+                }
+            }
+        }
+    }
+
+    void enq(T item, int threadId) {
+        if (!localData[threadId].purgedNodes.isEmpty()) {
+            reclaimPurged(threadId, PURGE_RECLAIM_BATCH);
+        }
+
+        VolatileNode* newNode = allocVolatileNode();
+        newNode->initialize(item);
+
+        while (true) {
+            VolatileNode* tail = Tail.load(ORDER_ACQUIRE);
+            VolatileNode* tailNext = nextOf(tail);
+            if (tailNext == nullptr) {
+                newNode->index = tail->index + 1;
+                if (tail->next.compare_exchange_strong(tailNext, newNode, ORDER_RELEASE, ORDER_RELAXED)) {
+                    if (newNode->index / SEGMENT_SIZE != tail->index / SEGMENT_SIZE) {
+                        segmentPreds[(newNode->index / SEGMENT_SIZE) % SEGMENT_DIRECTORY_SIZE].store(tail, ORDER_RELEASE);
+                    }
+                    persistNode(newNode);
+                    Tail.compare_exchange_strong(tail, newNode, ORDER_RELEASE, ORDER_RELAXED);
+                    break;
+                }
+            }
+            Tail.compare_exchange_strong(tail, tailNext, ORDER_RELEASE, ORDER_RELAXED);
+        }
+    }
+
+    // Remove the items up to index at once (all of them, if the queue holds no item of that index),
+    // persisting the new head index only once. Returns the head index after the purge.
+    // The removed nodes are freed lazily, by threadId's later operations or by reclaimPurged.
+    uint64_t purgeUntil(uint64_t index, int threadId) {
+        // Keeps spills from replacing the nodes this purge walks through; see spillSegment
+        purgesInProgress.fetch_add(1);
+        uint64_t headIndex = purge(index, threadId);
+        purgesInProgress.fetch_sub(1, ORDER_RELEASE);
+        return headIndex;
+    }
+
+    // Free up to maxNodes of the nodes threadId purged, e.g. all of them while the thread is idle
+    void reclaimPurged(int threadId, uint64_t maxNodes = UINT64_MAX) {
+        localData[threadId].purgedNodes.reclaim(maxNodes, [](VolatileNode* node) {
+            ssmem_free(volatileAlloc, node);
+        });
+    }
+
+    // Spill cold segments to the file in path once the resident ones take more than pmemBudget bytes.
+    // A queue that spilled is recovered only after setting the same file again.
+    bool setSpillFile(const char* path, uint64_t pmemBudget) {
+        spillFd = open(path, O_RDWR | O_CREAT, 0666);
+        spillBudget = pmemBudget;
+        return spillFd >= 0;
+    }
+
+    // Returns false, leaving the queue unusable, if a spilled segment it needs could not be read back
+    bool recover() {
+        initializeNodeToRetire();
+
+        uint64_t headIndex = getMaxLocalHeadIndex();
+
+        std::vector<Segment*> liveSegments; // In number order
+        getLiveSegmentsAndReleasePassedOnes(headIndex, liveSegments);
+
+        if (!loadEndSegments(headIndex, liveSegments)) {
+            return false;
+        }
+
+        recoverHead(headIndex); // volatileAlloc is assumed to be reset
+
+        recoverVolatileQueue(headIndex, liveSegments);
+
+        recoverSegmentCounters(liveSegments);
+
+        SFENCE();
+        return true;
+    }
+
+private:
+    uint64_t purge(uint64_t index, int threadId) {
+        VolatileNode* target = Head.load(ORDER_ACQUIRE);
+        while (true) {
+            VolatileNode* head = Head.load(ORDER_ACQUIRE);
+            if (target->index <= head->index) {
+                target = head; // Dequeuers passed it
+            }
+            while (target->index < index) {
+                VolatileNode* targetNext = nextOf(target);
+                if (targetNext == nullptr) {
+                    break;
+                }
+                // Head must not reach a marker whose segment's nodes are not back after it
+                if (targetNext->kind.load(ORDER_ACQUIRE) == SPILL_MARKER &&
+                    !loadSpilledSegment(markedSegment(targetNext))) {
+                    break;
+                }
+                target = targetNext;
+            }
+            if (target == head) {
+                return head->index;
+            }
+
+            if (Head.compare_exchange_strong(head, target, ORDER_ACQ_REL, ORDER_RELAXED)) {
+                __writeq(target->index, &(localData[threadId].headIndex));
+                SFENCE();
+
+                retirePassedSegments(head->index, target->index);
+
+                localData[threadId].purgedNodes.add(head, target);
+
+                return target->index;
+            }
+        }
+    }
+
+    std::atomic<VolatileNode*> Head DOUBLE_CACHE_LINE_ALIGNED;
+    std::atomic<VolatileNode*> Tail DOUBLE_CACHE_LINE_ALIGNED;
+
+    struct LocalData {
+        VolatileNode* nodeToRetire CACHE_LINE_ALIGNED;
+        uint64_t headIndex CACHE_LINE_ALIGNED;
+        PurgedNodes<VolatileNode> purgedNodes; // Volatile
+    } DOUBLE_CACHE_LINE_ALIGNED;
+
+    LocalData localData[MAX_THREADS];
+
+    // Segment number s lives in entry s % SEGMENT_DIRECTORY_SIZE.
+    // An entry of a spilled segment holds (s << 1) | 1, and its copy is at the entry's offset in the spill file.
+    std::atomic<Segment*> segments[SEGMENT_DIRECTORY_SIZE] DOUBLE_CACHE_LINE_ALIGNED;
+
+    // Volatile. The node just before the first node of segment s in the list, in entry s % SEGMENT_DIRECTORY_SIZE;
+    // for a spilled segment, the node its marker follows.
+    std::atomic<VolatileNode*> segmentPreds[SEGMENT_DIRECTORY_SIZE] DOUBLE_CACHE_LINE_ALIGNED;
+
+    int spillFd;
+    uint64_t spillBudget;
+    std::atomic<uint64_t> residentSegments;
+    std::atomic<int> purgesInProgress;
+    std::mutex spillLock; // Volatile, taken by one spilling enqueuer, or one reading dequeuer, at a time
+
+    void initializeNodeToRetire() {
+        for (int i = 0; i < MAX_THREADS; i++) {
+            localData[i].nodeToRetire = nullptr;
+            localData[i].purgedNodes.clear();
+        }
+    }
+
+    uint64_t getMaxLocalHeadIndex() {
+        uint64_t headIndex = 0;
+        for (int i = 0; i < MAX_THREADS; i++) {
+            if (localData[i].headIndex > headIndex)
+                headIndex = localData[i].headIndex;
+        }
+
+        return headIndex;
+    }
+
+    static bool isFrozen(VolatileNode* next) {
+        return (uintptr_t)next & 1;
+    }
+
+    static VolatileNode* frozen(VolatileNode* next) {
+        return (VolatileNode*)((uintptr_t)next | 1);
+    }
+
+    // Waits out a spill that is replacing the nodes after node
+    static VolatileNode* nextOf(VolatileNode* node) {
+        while (true) {
+            VolatileNode* next = node->next.load(ORDER_ACQUIRE);
+            if (!isFrozen(next)) {
+                return next;
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    static uint64_t markedSegment(VolatileNode* marker) {
+        return (marker->index + 1) / SEGMENT_SIZE;
+    }
+
+    static bool isSpilled(Segment* segment) {
+        return (uintptr_t)segment & 1;
+    }
+
+    static Segment* spilledSegment(uint64_t number) {
+        return (Segment*)((number << 1) | 1);
+    }
+
+    static uint64_t numberOf(Segment* segment) {
+        return isSpilled(segment) ? (uintptr_t)segment >> 1 : segment->number;
+    }
+
+    static off_t spillOffset(uint64_t number) {
+        return (off_t)(number % SEGMENT_DIRECTORY_SIZE) * sizeof(Segment);
+    }
+
+    static uint64_t lastIndexOfSegment(uint64_t number) {
+        return number * SEGMENT_SIZE + SEGMENT_SIZE - 1;
+    }
+
+    // Once Head reaches the last index of a segment, none of its nodes is in the queue anymore
+    bool isPassed(uint64_t segmentNumber) {
+        return Head.load()->index >= lastIndexOfSegment(segmentNumber);
+    }
+
+    Segment* allocSegment(uint64_t number) {
+        Segment* segment = static_cast<Segment*>(aligned_alloc(CACHE_LINE_SIZE, sizeof(Segment)));
+        assert(segment != nullptr);
+        memset((void*)segment, 0, sizeof(Segment));
+        segment->number = number;
+        for (size_t i = 0; i < sizeof(Segment); i += CACHE_LINE_SIZE) {
+            FLUSH((int8_t*)segment + i);
+        }
+        // The write-backs are ordered by the locked instruction that installs the segment
+        return segment;
+    }
+
+    // Returns nullptr if Head has already passed the segment
+    Segment* getSegment(uint64_t number) {
+        std::atomic<Segment*>& entry = segments[number % SEGMENT_DIRECTORY_SIZE];
+        while (true) {
+            Segment* segment = entry.load();
+            if (segment != nullptr) {
+                // Otherwise the entry is still taken by a segment SEGMENT_DIRECTORY_SIZE numbers earlier,
+                // namely the queue is longer than the directory can hold
+                assert(numberOf(segment) == number);
+                // Only segments whose slots were all written are spilled
+                assert(!isSpilled(segment));
+                return segment;
+            }
+            if (isPassed(number)) {
+                return nullptr;
+            }
+
+            Segment* newSegment = allocSegment(number);
+            if (!entry.compare_exchange_strong(segment, newSegment)) {
+                free(newSegment); // never published
+                continue;
+            }
+            FLUSH(&entry);
+            SFENCE();
+            residentSegments.fetch_add(1);
+
+            // The dequeuer that passed the segment might have looked for it before it was installed
+            if (isPassed(number)) {
+                retireSegment(number);
+                return nullptr;
+            }
+
+            if (spillFd >= 0 && isOverBudget()) {
+                spillColdSegments(number);
+            }
+            return newSegment;
+        }
+    }
+
+    void retireSegment(uint64_t number) {
+        std::atomic<Segment*>& entry = segments[number % SEGMENT_DIRECTORY_SIZE];
+        Segment* segment = entry.load();
+        if (segment == nullptr || numberOf(segment) != number) {
+            return;
+        }
+        if (entry.compare_exchange_strong(segment, nullptr)) {
+            FLUSH(&entry);
+            if (isSpilled(segment)) {
+                return; // Its place in the spill file is reused by the next segment of the entry
+            }
+            residentSegments.fetch_sub(1);
+            // Enqueuers might still be writing the slots of already dequeued nodes
+            ssmem_release(alloc, segment);
+        }
+    }
+
+    bool isOverBudget() {
+        return residentSegments.load() * sizeof(Segment) > spillBudget;
+    }
+
+    // Spill the segments between the hot ones next to Head and next to the newest segment, newest first,
+    // since they are dequeued last, until the resident segments fit in the budget
+    void spillColdSegments(uint64_t newestNumber) {
+        std::unique_lock<std::mutex> lock(spillLock, std::try_to_lock);
+        if (!lock.owns_lock()) {
+            return; // Another enqueuer is spilling
+        }
+
+        uint64_t headNumber = Head.load()->index / SEGMENT_SIZE;
+        for (uint64_t number = newestNumber - SEGMENT_SPILL_HOT_SEGMENTS - 1;
+             number < newestNumber && number > headNumber + SEGMENT_SPILL_HOT_SEGMENTS && isOverBudget(); number--) {
+            spillSegment(number);
+        }
+    }
+
+    /*
+    Replace the volatile nodes of a segment, from the one after pred to last, by a marker. pred's next is frozen
+    first, so no thread moves past pred meanwhile; the replacement is given up if Head already reached pred,
+    or a purge, which walks the list ahead of Head, is in progress.
+    */
+    void spillSegment(uint64_t number) {
+        std::atomic<Segment*>& entry = segments[number % SEGMENT_DIRECTORY_SIZE];
+        Segment* segment = entry.load();
+        if (segment == nullptr || isSpilled(segment) || segment->number != number) {
+            return;
+        }
+        if (segment->written.load() != SEGMENT_SIZE) {
+            return; // Enqueuers are still writing its slots
+        }
+        VolatileNode* pred = segmentPreds[number % SEGMENT_DIRECTORY_SIZE].load(ORDER_ACQUIRE);
+        VolatileNode* last = segmentPreds[(number + 1) % SEGMENT_DIRECTORY_SIZE].load(ORDER_ACQUIRE);
+        if (pred == nullptr || last == nullptr || last == pred) {
+            return;
+        }
+
+        if (pwrite(spillFd, segment, sizeof(Segment), spillOffset(number)) != (ssize_t)sizeof(Segment) ||
+            fdatasync(spillFd) != 0) {
+            return; // The segment stays resident
+        }
+
+        VolatileNode* first = pred->next.load(ORDER_ACQUIRE);
+        if (isFrozen(first) || !pred->next.compare_exchange_strong(first, frozen(first))) {
+            return;
+        }
+        if (Head.load()->index >= pred->index || purgesInProgress.load() != 0) {
+            pred->next.store(first, ORDER_RELEASE);
+            return;
+        }
+
+        // The entry refers to the file only once the copy is durable
+        if (!entry.compare_exchange_strong(segment, spilledSegment(number))) {
+            pred->next.store(first, ORDER_RELEASE);
+            return;
+        }
+        FLUSH(&entry);
+        SFENCE();
+
+        VolatileNode* marker = allocVolatileNode();
+        marker->initialize();
+        marker->kind.store(SPILL_MARKER, ORDER_RELAXED);
+        marker->index = number * SEGMENT_SIZE - 1;
+        marker->next.store(last->next.load(ORDER_ACQUIRE), ORDER_RELAXED);
+        pred->next.store(marker, ORDER_RELEASE);
+        segmentPreds[(number + 1) % SEGMENT_DIRECTORY_SIZE].store(marker, ORDER_RELEASE);
+
+        for (VolatileNode* node = first; node != last;) {
+            VolatileNode* next = node->next.load(ORDER_RELAXED);
+            ssmem_free(volatileAlloc, node);
+            node = next;
+        }
+        ssmem_free(volatileAlloc, last);
+
+        residentSegments.fetch_sub(1);
+        ssmem_release(alloc, segment);
+    }
+
+    // Returns nullptr if the copy cannot be read
+    Segment* readSpilledSegment(uint64_t number) {
+        if (spillFd < 0) {
+            return nullptr; // The spill file has to be set before recovery
+        }
+        Segment* segment = static_cast<Segment*>(aligned_alloc(CACHE_LINE_SIZE, sizeof(Segment)));
+        if (segment == nullptr) {
+            return nullptr;
+        }
+        if (pread(spillFd, segment, sizeof(Segment), spillOffset(number)) != (ssize_t)sizeof(Segment) ||
+            segment->number != number) {
+            free(segment);
+            return nullptr;
+        }
+        // The directory entry will refer to this copy instead of the file
+        for (size_t i = 0; i < sizeof(Segment); i += CACHE_LINE_SIZE) {
+            FLUSH((int8_t*)segment + i);
+        }
+        SFENCE();
+        segment->written.store(SEGMENT_SIZE, std::memory_order_relaxed); // Only complete segments are spilled
+        return segment;
+    }
+
+    // Read a spilled segment back into pmem, and link its nodes after its marker.
+    // Returns false if it is still spilled because the read failed.
+    bool loadSpilledSegment(uint64_t number) {
+        std::lock_guard<std::mutex> lock(spillLock);
+        std::atomic<Segment*>& entry = segments[number % SEGMENT_DIRECTORY_SIZE];
+        Segment* spilled = entry.load();
+        if (spilled == nullptr || !isSpilled(spilled) || numberOf(spilled) != number) {
+            return true; // Read back, or purged, meanwhile
+        }
+        VolatileNode* marker = segmentPreds[number % SEGMENT_DIRECTORY_SIZE].load(ORDER_ACQUIRE)->next.load(ORDER_ACQUIRE);
+
+        Segment* segment = readSpilledSegment(number);
+        if (segment == nullptr) {
+            return false;
+        }
+        if (!entry.compare_exchange_strong(spilled, segment)) {
+            free(segment); // never published
+            return true;
+        }
+        FLUSH(&entry);
+        SFENCE();
+        residentSegments.fetch_add(1);
+
+        VolatileNode* last;
+        VolatileNode* first = buildSegmentNodes(segment, 0, &last);
+        if (first != nullptr) {
+            last->next.store(marker->next.load(ORDER_ACQUIRE), ORDER_RELAXED);
+            marker->next.store(first, ORDER_RELEASE);
+            segmentPreds[(number + 1) % SEGMENT_DIRECTORY_SIZE].store(last, ORDER_RELEASE);
+        }
+        // Threads move past the marker only once they see it loaded
+        marker->kind.store(LOADED_MARKER, ORDER_RELEASE);
+        return true;
+    }
+
+    // Read back the spilled segments ahead of Head, up to SEGMENT_SPILL_HOT_SEGMENTS from headNumber
+    void prefetchSpilledSegments(uint64_t headNumber) {
+        for (uint64_t number = headNumber + 1; number <= headNumber + SEGMENT_SPILL_HOT_SEGMENTS; number++) {
+            Segment* segment = segments[number % SEGMENT_DIRECTORY_SIZE].load();
+            if (segment != nullptr && isSpilled(segment) && numberOf(segment) == number) {
+                loadSpilledSegment(number); // On failure, the dequeuer that reaches the marker tries again
+            }
+        }
+    }
+
+    // Chain up volatile nodes for the slots of segment linked with indices above minIndex.
+    // Returns the first one, or nullptr if there is none; last gets the last one, whose next is left to the caller.
+    VolatileNode* buildSegmentNodes(Segment* segment, uint64_t minIndex, VolatileNode** last) {
+        VolatileNode* first = nullptr;
+        VolatileNode* predNode = nullptr;
+        uint64_t firstIndex = segment->number * SEGMENT_SIZE;
+        for (uint64_t i = 0; i < SEGMENT_SIZE; i++) {
+            PersistentNode* persistentNode = &(segment->nodes[i]);
+            if (!persistentNode->linked || persistentNode->index != firstIndex + i || persistentNode->index <= minIndex) {
+                continue;
+            }
+            VolatileNode* node = allocVolatileNode();
+            node->initialize(persistentNode->item);
+            node->index = persistentNode->index;
+            if (predNode == nullptr) {
+                first = node;
+            } else {
+                predNode->next.store(node, ORDER_RELAXED);
+            }
+            predNode = node;
+        }
+        *last = predNode;
+        return first;
+    }
+
+    // Retire the segments whose last index Head passed when advancing from oldHeadIndex to newHeadIndex.
+    // Indices are consecutive, except for the gaps left by nodes that were lost in a crash.
+    void retirePassedSegments(uint64_t oldHeadIndex, uint64_t newHeadIndex) {
+        for (uint64_t number = oldHeadIndex / SEGMENT_SIZE; lastIndexOfSegment(number) <= newHeadIndex; number++) {
+            if (lastIndexOfSegment(number) > oldHeadIndex) {
+                retireSegment(number);
+            }
+        }
+    }
+
+    void persistNode(VolatileNode* node) {
+        Segment* segment = getSegment(node->index / SEGMENT_SIZE);
+        if (segment == nullptr) {
+            return; // The node was already dequeued
+        }
+
+        PersistentNode* persistentNode = &(segment->nodes[node->index % SEGMENT_SIZE]);
+        persistentNode->item = node->item;
+        persistentNode->index = node->index;
+        // verify index is set before linked
+        std::atomic_thread_fence(std::memory_order_release);
+        persistentNode->linked = true;
+        FLUSH_RANGE(persistentNode, sizeof(PersistentNode));
+        ISSUE_FLUSHES();
+        segment->written.fetch_add(1);
+    }
+
+    static bool segmentCmp(Segment* segment1, Segment* segment2) {
+        return numberOf(segment1) < numberOf(segment2);
+    }
+
+    void getLiveSegmentsAndReleasePassedOnes(uint64_t headIndex, std::vector<Segment*>& liveSegments) {
+        for (int i = 0; i < SEGMENT_DIRECTORY_SIZE; i++) {
+            Segment* segment = segments[i].load();
+            if (segment == nullptr) {
+                continue;
+            }
+            if (lastIndexOfSegment(numberOf(segment)) <= headIndex) {
+                segments[i].store(nullptr);
+                FLUSH(&segments[i]);
+                if (!isSpilled(segment)) {
+                    free(segment);
+                }
+                continue;
+            }
+            liveSegments.push_back(segment);
+        }
+        std::sort(liveSegments.begin(), liveSegments.end(), segmentCmp);
+    }
+
+    // Read back the spilled segments that Head lies in or that no resident segment follows, so Head and Tail
+    // are item nodes. Returns false if one cannot be read.
+    bool loadEndSegments(uint64_t headIndex, std::vector<Segment*>& liveSegments) {
+        bool isFollowedByResident = false;
+        for (size_t i = liveSegments.size(); i-- > 0;) {
+            Segment* segment = liveSegments[i];
+            uint64_t number = numberOf(segment);
+            if (!isSpilled(segment)) {
+                isFollowedByResident = true;
+                continue;
+            }
+            if (isFollowedByResident && number != headIndex / SEGMENT_SIZE) {
+                continue;
+            }
+            Segment* loaded = readSpilledSegment(number);
+            if (loaded == nullptr) {
+                return false;
+            }
+            segments[number % SEGMENT_DIRECTORY_SIZE].store(loaded);
+            FLUSH(&segments[number % SEGMENT_DIRECTORY_SIZE]);
+            liveSegments[i] = loaded;
+            isFollowedByResident = true;
+        }
+        return true;
+    }
+
+    void recoverHead(uint64_t headIndex) {
+        VolatileNode* head = allocVolatileNode();
+        head->initialize();
+        head->index = headIndex;
+        Head.store(head);
+    }
+
+    // Spilled segments stay spilled, each behind a marker, and are read back as Head approaches
+    void recoverVolatileQueue(uint64_t headIndex, const std::vector<Segment*>& liveSegments) {
+        for (int i = 0; i < SEGMENT_DIRECTORY_SIZE; i++) {
+            segmentPreds[i].store(nullptr, std::memory_order_relaxed);
+        }
+        VolatileNode* predNode = Head.load();
+        for (auto segment : liveSegments) {
+            uint64_t number = numberOf(segment);
+            segmentPreds[number % SEGMENT_DIRECTORY_SIZE].store(predNode, std::memory_order_relaxed);
+            if (isSpilled(segment)) {
+                VolatileNode* marker = allocVolatileNode();
+                marker->initialize();
+                marker->kind.store(SPILL_MARKER, std::memory_order_relaxed);
+                marker->index = number * SEGMENT_SIZE - 1;
+                predNode->next.store(marker);
+                predNode = marker;
+                continue;
+            }
+
+            VolatileNode* last;
+            VolatileNode* first = buildSegmentNodes(segment, headIndex, &last);
+            if (first != nullptr) {
+                predNode->next.store(first);
+                predNode = last;
+            }
+        }
+        VolatileNode* lastNode = predNode;
+        lastNode->next.store(nullptr);
+
+        Tail.store(lastNode);
+    }
+
+    // The slots up to Tail will not be written anymore, including those of nodes lost in the crash
+    void recoverSegmentCounters(const std::vector<Segment*>& liveSegments) {
+        uint64_t tailIndex = Tail.load()->index;
+        uint64_t resident = 0;
+        for (auto segment : liveSegments) {
+            if (isSpilled(segment)) {
+                continue;
+            }
+            uint64_t firstIndex = segment->number * SEGMENT_SIZE;
+            uint64_t written = tailIndex < firstIndex ? 0 : std::min<uint64_t>(tailIndex - firstIndex + 1, SEGMENT_SIZE);
+            segment->written.store(written, std::memory_order_relaxed);
+            resident++;
+        }
+        residentSegments.store(resident);
+    }
+};
+
+#endif /* SEGMENTED_Q_H_ */
@@ -0,0 +1,462 @@
+#pragma once
+
+#ifndef SKIPLIST_PQ_H_
+#define SKIPLIST_PQ_H_
+
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+#include <ssmem.h>
+#include <listrank.h>
+
+#include "utilities.h"
+
+#define SKIPLIST_MAX_LEVEL    16 /* levels of the skiplist; a node goes up a level with probability 1/4 */
+#define SKIPLIST_BOUND_OFFSET 32 /* deleted nodes at the front of the bottom level before a deleteMin unlinks them */
+
+/*
+A durable lock-free priority queue of items with uint64_t keys, smallest key first, after Lindén and Jonsson's skiplist:
+deleteMin deletes the first node by marking the bottom-level next pointer of its predecessor, so the deleted nodes
+always form a prefix of the bottom level, which is unlinked with a single CAS once it is SKIPLIST_BOUND_OFFSET nodes long.
+Only the bottom level is persistent, and only as the set of its nodes: a persistent node holds an item and its key,
+tagged with the queue's id and a checksum, as in OptUnlinkedQ, and is persisted before it is linked.
+deleteMin clears the tag of the node it took, and of the deleted nodes before it that are not persisted as such yet,
+with a single fence. Recovery sorts the tagged nodes by key and rebuilds the skiplist, its upper levels in parallel.
+Items of equal keys are not ordered.
+*/
+template<class T> class SkiplistPQ {
+private:
+    class PersistentNode {
+    public:
+        T item;
+        uint64_t key;
+        uint32_t linked; // The id of the queue the node belongs to, 0 once its item was deleted
+        uint32_t checksum; // Over the other fields
+
+        uint32_t computeChecksum() const {
+            uint64_t hash = CHECKSUM_SEED;
+            hash = checksumUpdate(hash, &item, sizeof(item));
+            hash = checksumUpdate(hash, &key, sizeof(key));
+            hash = checksumUpdate(hash, &linked, sizeof(linked));
+            return checksumFinish(hash);
+        }
+
+        // A node whose lines were persisted only in part fails this
+        bool isIntact() const {
+            return checksum == computeChecksum();
+        }
+    } __attribute__((aligned (32)));
+
+    class VolatileNode {
+    public:
+        uint64_t key;
+        T item;
+        PersistentNode* persistentNode;
+        int height;
+        std::atomic<bool> inserting; // Until its upper levels are linked, which keeps it from being unlinked
+        std::atomic<bool> isDeletionPersisted;
+        std::atomic<VolatileNode*> next[SKIPLIST_MAX_LEVEL]; // The mark of next[0] tells that the next node is deleted
+    } __attribute__((aligned (32)));
+
+    VolatileNode* allocVolatileNode() {
+        void* volatileNode = ssmem_alloc(volatileAlloc, sizeof(VolatileNode));
+        return static_cast<VolatileNode*>(volatileNode);
+    }
+
+    template<class Q> friend class QueueRegistry;
+
+public:
+    // Queues whose nodes share an allocator must have distinct ids, for telling their nodes apart in recovery
+    SkiplistPQ(uint32_t id = 1) :
+        queueId(id),
+        recoveryThreads(1)
+    {
+        initializeSentinels();
+        for (int i = 0; i < MAX_THREADS; i++) {
+            localData[i].seed = i + 1;
+        }
+    }
+
+    void insert(uint64_t key, T item, int threadId) {
+        PersistentNode* persistentNode = static_cast<PersistentNode*>(ssmem_alloc(alloc, sizeof(PersistentNode)));
+        persistentNode->item = item;
+        persistentNode->key = key;
+        persistentNode->linked = queueId;
+        persistentNode->checksum = persistentNode->computeChecksum();
+        FLUSH_RANGE(persistentNode, sizeof(PersistentNode));
+        // Persisted before it is linked, so that its write-back cannot land after the tombstone of a deleteMin
+        SFENCE();
+
+        VolatileNode* newNode = allocVolatileNode();
+        newNode->key = key;
+        newNode->item = item;
+        newNode->persistentNode = persistentNode;
+        newNode->height = randomHeight(threadId);
+        newNode->inserting.store(true, ORDER_RELAXED);
+        newNode->isDeletionPersisted.store(false, ORDER_RELAXED);
+
+        VolatileNode* preds[SKIPLIST_MAX_LEVEL];
+        VolatileNode* succs[SKIPLIST_MAX_LEVEL];
+        VolatileNode* deleted;
+        while (true) {
+            deleted = findPreds(key, preds, succs);
+            newNode->next[0].store(succs[0], ORDER_RELAXED);
+            VolatileNode* expected = succs[0];
+            if (preds[0]->next[0].compare_exchange_strong(expected, newNode, ORDER_RELEASE, ORDER_RELAXED)) {
+                break;
+            }
+        }
+
+        for (int i = 1; i < newNode->height;) {
+            newNode->next[i].store(succs[i], ORDER_RELAXED);
+            // Deleted nodes are not linked at the upper levels, as the prefix they are in is about to be unlinked
+            if (isMarked(newNode->next[0].load(ORDER_ACQUIRE)) || isMarked(succs[i]->next[0].load(ORDER_ACQUIRE)) ||
+                succs[i] == deleted) {
+                break;
+            }
+            VolatileNode* expected = succs[i];
+            if (preds[i]->next[i].compare_exchange_strong(expected, newNode, ORDER_RELEASE, ORDER_RELAXED)) {
+                i++;
+                continue;
+            }
+            deleted = findPreds(key, preds, succs);
+            if (succs[0] != newNode) {
+                break; // It was deleted, or a node of the same key was inserted before it
+            }
+        }
+        newNode->inserting.store(false, ORDER_RELEASE);
+    }
+
+    // Returns false if the queue is empty
+    bool deleteMin(uint64_t* key, T* item, int threadId) {
+        VolatileNode* observedFirst = Head->next[0].load(ORDER_ACQUIRE);
+        VolatileNode* newFirst = nullptr; // The deleted node that becomes the first one if the prefix is unlinked
+        uint64_t offset = 0;
+        bool didFlush = false;
+
+        VolatileNode* x = Head;
+        while (true) {
+            offset++;
+            VolatileNode* next = x->next[0].load(ORDER_ACQUIRE);
+            if (getUnmarked(next) == Tail) {
+                // The deletions of the prefix must be durable before reporting the empty state
+                if (didFlush) {
+                    SFENCE();
+                }
+                return false;
+            }
+            if (newFirst == nullptr && x->inserting.load(ORDER_ACQUIRE)) {
+                newFirst = x;
+            }
+
+            bool isTaken = false;
+            while (!isMarked(next)) {
+                if (x->next[0].compare_exchange_weak(next, getMarked(next), ORDER_ACQ_REL, ORDER_ACQUIRE)) {
+                    isTaken = true;
+                    break;
+                }
+            }
+            x = getUnmarked(next);
+            if (!isTaken) {
+                // Deleted by another deleteMin, which may not have persisted its tombstone yet
+                didFlush |= persistDeletion(x);
+                continue;
+            }
+            break;
+        }
+
+        *key = x->key;
+        *item = x->item;
+        persistDeletion(x);
+        SFENCE();
+        x->isDeletionPersisted.store(true, ORDER_RELEASE);
+
+        if (newFirst == nullptr) {
+            newFirst = x;
+        }
+        if (offset > SKIPLIST_BOUND_OFFSET && Head->next[0].load(ORDER_ACQUIRE) == observedFirst &&
+            Head->next[0].compare_exchange_strong(observedFirst, getMarked(newFirst), ORDER_ACQ_REL, ORDER_RELAXED)) {
+            restructure();
+            // The unlinked nodes were persisted as deleted by this traversal at the latest
+            VolatileNode* node = getUnmarked(observedFirst);
+            while (node != newFirst) {
+                VolatileNode* next = getUnmarked(node->next[0].load(ORDER_ACQUIRE));
+                ssmem_free(alloc, node->persistentNode);
+                ssmem_free(volatileAlloc, node);
+                node = next;
+            }
+        }
+        return true;
+    }
+
+    // Have recovery sort the nodes and build the upper levels on numThreads threads (1, the default)
+    void setRecoveryThreads(int numThreads) {
+        recoveryThreads = numThreads;
+    }
+
+    void recover() {
+        Recovery recovery;
+        recoverBegin(recovery);
+
+        std::vector<PersistentNode*> queueNodes;
+        getQueueNodesAndRetireOthers(recovery, queueNodes); // retiring alloc's nodes; volatileAlloc is assumed to be reset
+
+        recoverEnd(recovery, queueNodes);
+    }
+
+private:
+    VolatileNode* Head; // Its next pointers lead to the first node of each level
+    VolatileNode* Tail; // After the last node of each level
+    uint32_t queueId;
+    int recoveryThreads;
+
+    struct LocalData {
+        uint32_t seed CACHE_LINE_ALIGNED; // Volatile, of the heights of the nodes the thread inserts
+    } CACHE_LINE_ALIGNED;
+
+    LocalData localData[MAX_THREADS];
+
+    static bool isMarked(VolatileNode* node) {
+        return ((uintptr_t)node & 1) != 0;
+    }
+
+    static VolatileNode* getMarked(VolatileNode* node) {
+        return (VolatileNode*)((uintptr_t)node | 1);
+    }
+
+    static VolatileNode* getUnmarked(VolatileNode* node) {
+        return (VolatileNode*)((uintptr_t)node & ~(uintptr_t)1);
+    }
+
+    void initializeSentinels() {
+        Head = allocVolatileNode();
+        Tail = allocVolatileNode();
+        Head->inserting.store(false, ORDER_RELAXED);
+        Tail->inserting.store(false, ORDER_RELAXED);
+        for (int i = 0; i < SKIPLIST_MAX_LEVEL; i++) {
+            Head->next[i].store(Tail, ORDER_RELAXED);
+            Tail->next[i].store(nullptr, ORDER_RELAXED);
+        }
+    }
+
+    // 1 plus the number of times a 1/4 chance came up in a row, given random bits
+    static int heightOf(uint64_t bits) {
+        int height = 1;
+        while (height < SKIPLIST_MAX_LEVEL && (bits & 3) == 0) {
+            height++;
+            bits >>= 2;
+        }
+        return height;
+    }
+
+    int randomHeight(int threadId) {
+        uint32_t& seed = localData[threadId].seed;
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return heightOf(seed);
+    }
+
+    /*
+    The predecessor and successor of key at each level, skipping the deleted nodes, so that a new node goes after them.
+    Returns the last node found deleted by the mark of its predecessor at the bottom level, if any.
+    */
+    VolatileNode* findPreds(uint64_t key, VolatileNode** preds, VolatileNode** succs) {
+        VolatileNode* x = Head;
+        VolatileNode* deleted = nullptr;
+        for (int i = SKIPLIST_MAX_LEVEL - 1; i >= 0; i--) {
+            VolatileNode* xNext = x->next[i].load(ORDER_ACQUIRE);
+            bool isNextDeleted = isMarked(xNext);
+            xNext = getUnmarked(xNext);
+            // A node whose next node is deleted is deleted too, as the deleted nodes form a prefix
+            while (xNext != Tail && (xNext->key < key || isMarked(xNext->next[0].load(ORDER_ACQUIRE)) ||
+                (i == 0 && isNextDeleted))) {
+                if (i == 0 && isNextDeleted) {
+                    deleted = xNext;
+                }
+                x = xNext;
+                xNext = x->next[i].load(ORDER_ACQUIRE);
+                isNextDeleted = isMarked(xNext);
+                xNext = getUnmarked(xNext);
+            }
+            preds[i] = x;
+            succs[i] = xNext;
+        }
+        return deleted;
+    }
+
+    // Returns whether a flush was issued
+    bool persistDeletion(VolatileNode* node) {
+        if (node->isDeletionPersisted.load(ORDER_ACQUIRE)) {
+            return false;
+        }
+        node->persistentNode->linked = 0;
+        FLUSH(&node->persistentNode->linked);
+        return true;
+    }
+
+    // Point Head's upper levels past the deleted nodes whose next nodes are deleted, which were just unlinked
+    void restructure() {
+        VolatileNode* pred = Head;
+        int i = SKIPLIST_MAX_LEVEL - 1;
+        while (i > 0) {
+            VolatileNode* first = Head->next[i].load(ORDER_ACQUIRE);
+            if (!isMarked(first->next[0].load(ORDER_ACQUIRE))) {
+                i--;
+                continue;
+            }
+            VolatileNode* curr = pred->next[i].load(ORDER_ACQUIRE);
+            while (isMarked(curr->next[0].load(ORDER_ACQUIRE))) {
+                pred = curr;
+                curr = pred->next[i].load(ORDER_ACQUIRE);
+            }
+            if (Head->next[i].compare_exchange_strong(first, curr, ORDER_ACQ_REL, ORDER_RELAXED)) {
+                i--;
+            }
+        }
+    }
+
+    static bool nodeCmp(PersistentNode* node1, PersistentNode* node2) {
+        return node1->key < node2->key;
+    }
+
+    /*
+    Recovery is split into phases, so that QueueRegistry can recover all the queues sharing alloc
+    with a single scan of its chunks:
+    recoverBegin, then isQueueNode or retireNonQueueNode on every node of the chunks, then recoverEnd.
+    */
+    typedef PersistentNode RecoveryNode;
+
+    struct Recovery {};
+
+    static uint32_t ownerOf(PersistentNode* node) {
+        return node->linked;
+    }
+
+    void recoverBegin(Recovery& recovery) {}
+
+    bool isQueueNode(const Recovery& recovery, PersistentNode* node) {
+        return node->linked == queueId && node->isIntact();
+    }
+
+    bool retireNonQueueNode(const Recovery& recovery, PersistentNode* node) {
+        return retireOrphanNode(node);
+    }
+
+    // Returns whether a flush was issued. A retired node is left untagged, so that it never comes back once reused.
+    static bool retireOrphanNode(PersistentNode* node) {
+        if (node->linked == 0) {
+            return false;
+        }
+        node->linked = 0;
+        FLUSH(&node->linked);
+        return true;
+    }
+
+    void getQueueNodesAndRetireOthers(Recovery& recovery, std::vector<PersistentNode*>& queueNodes) {
+        bool didFlush = false;
+        for (auto curr = alloc->mem_chunks; curr != nullptr; curr = curr->next) {
+            PersistentNode* currChunk = static_cast<PersistentNode*>(curr->obj);
+            uint64_t numOfNodes = SSMEM_DEFAULT_MEM_SIZE / sizeof(PersistentNode);
+            for (uint64_t i = 0; i < numOfNodes; i++) {
+                PersistentNode* currNode = currChunk + i;
+                if (isQueueNode(recovery, currNode)) {
+                    queueNodes.push_back(currNode);
+                } else {
+                    didFlush |= retireNonQueueNode(recovery, currNode);
+                    ssmem_free(alloc, currNode);
+                }
+            }
+        }
+        if (didFlush) {
+            SFENCE();
+        }
+    }
+
+    void recoverEnd(Recovery& recovery, std::vector<PersistentNode*>& queueNodes) {
+        sortByKey(queueNodes);
+        uint64_t n = queueNodes.size();
+
+        // The volatile nodes are allocated on the calling thread, as the allocators are per thread
+        initializeSentinels();
+        std::vector<VolatileNode*> nodes(n);
+        for (uint64_t i = 0; i < n; i++) {
+            nodes[i] = allocVolatileNode();
+        }
+
+        // Each range links its own nodes at every level, from its end, and the ranges are then linked to each other
+        uint64_t numRanges = std::max(1, recoveryThreads);
+        uint64_t rangeSize = (n + numRanges - 1) / numRanges;
+        std::vector<VolatileNode*> firsts(numRanges * SKIPLIST_MAX_LEVEL, nullptr);
+        std::vector<VolatileNode*> lasts(numRanges * SKIPLIST_MAX_LEVEL, nullptr);
+        forEachRange(recoveryThreads, numRanges, [&](uint64_t rangesBegin, uint64_t rangesEnd) {
+            for (uint64_t r = rangesBegin; r < rangesEnd; r++) {
+                VolatileNode** first = &firsts[r * SKIPLIST_MAX_LEVEL];
+                VolatileNode** last = &lasts[r * SKIPLIST_MAX_LEVEL];
+                uint64_t begin = std::min(n, r * rangeSize);
+                for (uint64_t i = std::min(n, begin + rangeSize); i-- > begin;) {
+                    VolatileNode* node = nodes[i];
+                    PersistentNode* persistentNode = queueNodes[i];
+                    node->key = persistentNode->key;
+                    node->item = persistentNode->item;
+                    node->persistentNode = persistentNode;
+                    node->height = heightOf(mix(i));
+                    node->inserting.store(false, ORDER_RELAXED);
+                    node->isDeletionPersisted.store(false, ORDER_RELAXED);
+                    for (int l = 0; l < node->height; l++) {
+                        node->next[l].store(first[l], ORDER_RELAXED);
+                        if (last[l] == nullptr) {
+                            last[l] = node;
+                        }
+                        first[l] = node;
+                    }
+                }
+            }
+        });
+
+        for (int l = 0; l < SKIPLIST_MAX_LEVEL; l++) {
+            VolatileNode* following = Tail;
+            for (uint64_t r = numRanges; r-- > 0;) {
+                if (firsts[r * SKIPLIST_MAX_LEVEL + l] != nullptr) {
+                    lasts[r * SKIPLIST_MAX_LEVEL + l]->next[l].store(following, ORDER_RELAXED);
+                    following = firsts[r * SKIPLIST_MAX_LEVEL + l];
+                }
+            }
+            Head->next[l].store(following, ORDER_RELAXED);
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    // Random bits for the height of the i-th recovered node, without a generator shared by the recovery threads
+    static uint64_t mix(uint64_t i) {
+        uint64_t z = i + 0x9e3779b97f4a7c15UL;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9UL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebUL;
+        return z ^ (z >> 31);
+    }
+
+    // Each thread sorts a range, then the sorted runs are merged in pairs, the merges of a round in parallel
+    void sortByKey(std::vector<PersistentNode*>& nodes) {
+        uint64_t n = nodes.size();
+        uint64_t numRanges = std::max(1, recoveryThreads);
+        uint64_t rangeSize = std::max<uint64_t>(1, (n + numRanges - 1) / numRanges);
+        forEachRange(recoveryThreads, numRanges, [&](uint64_t rangesBegin, uint64_t rangesEnd) {
+            for (uint64_t r = rangesBegin; r < rangesEnd; r++) {
+                std::sort(nodes.begin() + std::min(n, r * rangeSize), nodes.begin() + std::min(n, (r + 1) * rangeSize), nodeCmp);
+            }
+        });
+        for (uint64_t width = rangeSize; width < n; width *= 2) {
+            uint64_t numMerges = (n + 2 * width - 1) / (2 * width);
+            forEachRange(recoveryThreads, numMerges, [&](uint64_t mergesBegin, uint64_t mergesEnd) {
+                for (uint64_t m = mergesBegin; m < mergesEnd; m++) {
+                    uint64_t begin = m * 2 * width;
+                    std::inplace_merge(nodes.begin() + begin, nodes.begin() + std::min(n, begin + width),
+                        nodes.begin() + std::min(n, begin + 2 * width), nodeCmp);
+                }
+            });
+        }
+    }
+};
+
+#endif /* SKIPLIST_PQ_H_ */
@@ -0,0 +1,80 @@
+#pragma once
+
+#ifndef STANDBY_H_
+#define STANDBY_H_
+
+#include <map>
+#include <algorithm>
+#include <stdint.h>
+
+#include <replication.h>
+
+#include "utilities.h"
+
+/*
+Keeps the durable queue q of a standby process a replica of a primary queue, from the records the primary
+publishes to ring (see OptLinkedQ::startReplication). q, in the standby's own pool, starts empty and mirrors
+the items the primary enqueued since it started replicating, minus the ones its head passed.
+Item records are applied in index order, so q is always a prefix of the primary's persisted items.
+To take over, stop polling and use q; after a crash of the standby itself, recover q and reseed it.
+*/
+template<template<class> class Q, class T> class Standby {
+public:
+    Standby(Q<T>* queue, ReplicationRing<T>* r, int id) :
+        q(queue),
+        ring(r),
+        threadId(id),
+        nextIndex(r->getBaseIndex() + 1),
+        removedIndex(r->getBaseIndex()),
+        headIndex(r->getBaseIndex())
+    {}
+
+    // Apply up to maxRecords records of the ring to q. Returns the number of records consumed.
+    uint64_t poll(uint64_t maxRecords = UINT64_MAX) {
+        typename ReplicationRing<T>::Record record;
+        uint64_t numRecords = 0;
+        while (numRecords < maxRecords && ring->consume(record)) {
+            numRecords++;
+            if (record.kind == ReplicationRing<T>::Item) {
+                if (record.index >= nextIndex) {
+                    pending[record.index] = record.item;
+                }
+            } else {
+                headIndex = std::max(headIndex, record.index);
+            }
+        }
+
+        while (!pending.empty() && pending.begin()->first == nextIndex) {
+            q->enq(pending.begin()->second, threadId);
+            pending.erase(pending.begin());
+            nextIndex++;
+        }
+        // The primary may persist the dequeue of an item before its enqueuer publishes it
+        T item;
+        while (removedIndex < std::min(headIndex, nextIndex - 1) && q->deq(&item, threadId)) {
+            removedIndex++;
+        }
+        return numRecords;
+    }
+
+    // False once the primary dropped records because the standby fell behind; q must then be reseeded
+    bool isInSync() const {
+        return !ring->isOverflowed();
+    }
+
+    // The primary's index of the last item q holds
+    uint64_t getReplicatedIndex() const {
+        return nextIndex - 1;
+    }
+
+private:
+    Q<T>* q;
+    ReplicationRing<T>* ring;
+    int threadId;
+    std::map<uint64_t, T> pending; // Items that arrived before an item of a smaller index
+    uint64_t nextIndex; // The primary's index of the next item to enqueue to q
+    uint64_t removedIndex; // The primary's index of the last item dequeued from q
+    uint64_t headIndex; // The primary's latest head index
+};
+
+#endif /* STANDBY_H_ */
@@ -0,0 +1,469 @@
+#pragma once
+
+#ifndef TIMESTAMPED_Q_H_
+#define TIMESTAMPED_Q_H_
+
+#include <atomic>
+#include <set>
+#include <vector>
+#include <algorithm>
+#include <x86intrin.h>
+
+#include <ssmem.h>
+
+#include "utilities.h"
+
+/*
+A durable variant of the timestamped queue of Dodds, Haas and Kirsch (POPL 2015).
+Each producer appends to its own buffer, a list only it enqueues to, so enqueues share no CAS.
+Items are stamped with the (invariant) TSC, and a dequeuer removes the oldest buffer head across all buffers,
+ignoring items stamped after it started, which are linearized after it.
+Indices are per buffer. Each buffer persists the index of its last removed node, and the last enqueues
+of its producer in two cells, as in OptLinkedQ, from which recovery follows the pred pointers.
+The removed and persisted indices follow the ORDER_* profile of utilities.h, but the buffer heads, the next pointers
+and numBuffers stay seq_cst: a dequeue that finds the queue empty double-collects them, which takes a single total
+order of its loads and the producers' stores to show that all buffers were empty at once.
+*/
+template<class T> class TimestampedQ {
+private:
+    class PersistentNode {
+    public:
+        T item;
+        PersistentNode* pred;
+        uint64_t timestamp;
+        uint64_t index;
+        uint32_t owner;  // The id of the queue the node was allocated for
+        uint32_t buffer; // The id of the producer that enqueued it
+    } __attribute__((aligned (32)));
+
+    class VolatileNode {
+    public:
+        T item;
+        uint64_t timestamp;
+        uint64_t index;
+        std::atomic<VolatileNode*> next;
+        PersistentNode* persistentNode;
+    } __attribute__((aligned (32)));
+
+    static const int ValidBitPositionInPointer = 0;
+    static const int ValidBitPositionInIndex = sizeof(uint64_t) * 8 - 1;
+
+    VolatileNode* allocVolatileNode() {
+        void* volatileNode = ssmem_alloc(volatileAlloc, sizeof(VolatileNode));
+        return static_cast<VolatileNode*>(volatileNode);
+    }
+
+    template<class Q> friend class QueueRegistry;
+
+public:
+    // Queues whose nodes share an allocator must have distinct ids, for telling their nodes apart in recovery
+    TimestampedQ(uint32_t id = 1) :
+        numBuffers(0),
+        timestampOffset(0),
+        queueId(id)
+    {
+        for (int i = 0; i < MAX_THREADS; i++) {
+            localData[i].nodeToRetire = nullptr;
+
+            initializeBuffer(i, 0);
+            resetLastEnqueueForBuffer(i);
+            buffers[i].removedIndex.store(0, std::memory_order_relaxed);
+            FLUSH(&buffers[i].removedIndex);
+        }
+        SFENCE();
+    }
+
+    bool deq(T* dequeuedItem, int threadId) {
+        VolatileNode* heads[MAX_THREADS];
+        while (true) {
+            uint64_t startTimestamp = newTimestamp();
+            int n = numBuffers.load();
+            int oldestBuffer = -1;
+            bool foundLater = false;
+            bool didFlush = false;
+
+            for (int i = 0; i < n; i++) {
+                heads[i] = buffers[i].head.load();
+                // A removal seen here must be durable before this dequeue returns
+                didFlush |= helpPersistRemoval(buffers[i], heads[i]->index);
+
+                VolatileNode* headNext = heads[i]->next.load();
+                if (headNext == nullptr) {
+                    continue;
+                }
+                if (headNext->timestamp > startTimestamp) {
+                    foundLater = true; // Enqueued after this dequeue started
+                    continue;
+                }
+                if (oldestBuffer == -1 || headNext->timestamp < heads[oldestBuffer]->next.load()->timestamp) {
+                    oldestBuffer = i;
+                }
+            }
+
+            if (oldestBuffer != -1) {
+                Buffer& buffer = buffers[oldestBuffer];
+                VolatileNode* head = heads[oldestBuffer];
+                VolatileNode* headNext = head->next.load();
+                if (!buffer.head.compare_exchange_strong(head, headNext)) {
+                    continue;
+                }
+                *dequeuedItem = headNext->item;
+                helpPersistRemoval(buffer, headNext->index);
+                SFENCE();
+                advancePersistedIndex(buffer, headNext->index);
+
+                retireNode(threadId);
+                localData[threadId].nodeToRetire = head;
+
+                return true;
+            }
+            if (foundLater || !isStillEmpty(heads, n)) {
+                continue;
+            }
+            if (didFlush) {
+                SFENCE();
+            }
+            return false;
+        }
+    }
+
+    void enq(T item, int threadId) {
+        registerBuffer(threadId);
+        Buffer& buffer = buffers[threadId];
+        VolatileNode* tail = buffer.tail;
+
+        VolatileNode* newNode = allocVolatileNode();
+        newNode->item = item;
+        newNode->timestamp = newTimestamp();
+        newNode->index = tail->index + 1;
+        newNode->next.store(nullptr, std::memory_order_relaxed);
+
+        PersistentNode* persistentNode = static_cast<PersistentNode*>(ssmem_alloc(alloc, sizeof(PersistentNode)));
+        newNode->persistentNode = persistentNode;
+        persistentNode->item = item;
+        persistentNode->pred = tail->persistentNode;
+        persistentNode->timestamp = newNode->timestamp;
+        persistentNode->owner = queueId;
+        persistentNode->buffer = threadId;
+        std::atomic_thread_fence(std::memory_order_release); // the other fields must be written before the index
+        persistentNode->index = newNode->index;
+
+        // Only this thread appends to its buffer, so no CAS is needed
+        tail->next.store(newNode);
+        buffer.tail = newNode;
+
+        FLUSH_RANGE(persistentNode, sizeof(PersistentNode));
+        recordLastEnqueue(buffer, newNode);
+        SFENCE();
+    }
+
+    void recover() {
+        Recovery recovery;
+        recoverBegin(recovery);
+
+        retireNonQueueNodes(recovery); // retiring alloc's nodes; volatileAlloc is assumed to be reset
+
+        std::vector<PersistentNode*> queueNodes(recovery.queueNodes.begin(), recovery.queueNodes.end());
+        recoverEnd(recovery, queueNodes);
+    }
+
+private:
+    struct LastEnqueue {
+        PersistentNode* ptr;
+        uint64_t index;
+    };
+
+    struct Buffer {
+        std::atomic<VolatileNode*> head CACHE_LINE_ALIGNED; // Volatile, advanced by dequeuers
+        VolatileNode* tail;                                 // Volatile, advanced by the producer only
+        std::atomic<uint64_t> removedIndex CACHE_LINE_ALIGNED;
+        std::atomic<uint64_t> persistedIndex; // Volatile, removedIndex is known to be durable up to it
+        int validBit;
+        int lastEnqueuesIndex;
+        LastEnqueue lastEnqueues[2] CACHE_LINE_ALIGNED;
+    } DOUBLE_CACHE_LINE_ALIGNED;
+
+    struct LocalData {
+        VolatileNode* nodeToRetire;
+    } DOUBLE_CACHE_LINE_ALIGNED;
+
+    Buffer buffers[MAX_THREADS];
+    LocalData localData[MAX_THREADS];
+    std::atomic<int> numBuffers DOUBLE_CACHE_LINE_ALIGNED; // Volatile, buffers 0..numBuffers-1 might be non-empty
+    uint64_t timestampOffset; // Volatile, keeps timestamps increasing across a restart, which resets the TSC
+    uint32_t queueId;
+
+    uint64_t newTimestamp() {
+        unsigned int aux;
+        return __rdtscp(&aux) + timestampOffset;
+    }
+
+    void registerBuffer(int threadId) {
+        int n = numBuffers.load(std::memory_order_relaxed);
+        while (n <= threadId && !numBuffers.compare_exchange_weak(n, threadId + 1)) {}
+    }
+
+    // The head of a buffer is a dummy node, whose index is that of the last node removed from it
+    void initializeBuffer(int bufferId, uint64_t removedIndex) {
+        VolatileNode* dummyNode = allocVolatileNode();
+        dummyNode->timestamp = 0;
+        dummyNode->index = removedIndex;
+        dummyNode->next.store(nullptr, std::memory_order_relaxed);
+        dummyNode->persistentNode = nullptr; // recovery never goes past the removed index
+        buffers[bufferId].head.store(dummyNode, std::memory_order_relaxed);
+        buffers[bufferId].tail = dummyNode;
+        buffers[bufferId].persistedIndex.store(removedIndex, std::memory_order_relaxed);
+    }
+
+    // Returns whether a flush was issued; the caller fences
+    bool helpPersistRemoval(Buffer& buffer, uint64_t index) {
+        if (buffer.persistedIndex.load(ORDER_ACQUIRE) >= index) {
+            return false;
+        }
+        uint64_t removedIndex = buffer.removedIndex.load(ORDER_ACQUIRE);
+        while (removedIndex < index &&
+               !buffer.removedIndex.compare_exchange_weak(removedIndex, index, ORDER_ACQ_REL, ORDER_ACQUIRE)) {}
+        FLUSH(&buffer.removedIndex);
+        return true;
+    }
+
+    void advancePersistedIndex(Buffer& buffer, uint64_t index) {
+        uint64_t persistedIndex = buffer.persistedIndex.load(ORDER_ACQUIRE);
+        while (persistedIndex < index &&
+               !buffer.persistedIndex.compare_exchange_weak(persistedIndex, index, ORDER_RELEASE, ORDER_RELAXED)) {}
+    }
+
+    // No buffer gained a node since heads were read, so all of them were empty at once in between
+    bool isStillEmpty(VolatileNode** heads, int n) {
+        if (numBuffers.load() != n) {
+            return false;
+        }
+        for (int i = 0; i < n; i++) {
+            if (buffers[i].head.load() != heads[i] || heads[i]->next.load() != nullptr) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void retireNode(int threadId) {
+        VolatileNode* nodeToRetire = localData[threadId].nodeToRetire;
+        if (nodeToRetire == nullptr) { // It equals NULL in the first successful deq
+            return;
+        }
+        if (nodeToRetire->persistentNode) { // A buffer's initial dummy node has none
+            ssmem_free(alloc, nodeToRetire->persistentNode);
+        }
+        ssmem_free(volatileAlloc, nodeToRetire);
+    }
+
+    uint64_t zeroBit(uint64_t value, int bitIndex) {
+        return value & ~(1UL << bitIndex);
+    }
+
+    uint64_t applyBit(uint64_t value, int bitIndex, uint64_t bitValue) {
+        return zeroBit(value, bitIndex) | (bitValue << bitIndex);
+    }
+
+    uint64_t getBit(uint64_t value, int bitIndex) {
+        return (value >> bitIndex) & 1UL;
+    }
+
+    // See OptLinkedQ::recordLastEnqueue
+    void recordLastEnqueue(Buffer& buffer, VolatileNode* newNode) {
+        int i = buffer.lastEnqueuesIndex;
+
+        __writeq((void*)applyBit((uint64_t)newNode->persistentNode, ValidBitPositionInPointer, buffer.validBit), &(buffer.lastEnqueues[i].ptr));
+        __writeq(applyBit(newNode->index, ValidBitPositionInIndex, buffer.validBit), &(buffer.lastEnqueues[i].index));
+
+        buffer.validBit ^= i;
+        buffer.lastEnqueuesIndex ^= 1;
+    }
+
+    void resetLastEnqueueForBuffer(int bufferId) {
+        Buffer& buffer = buffers[bufferId];
+        __writeq(0, &(buffer.lastEnqueues[0].index));
+        __writeq(0, &(buffer.lastEnqueues[1].index));
+        __writeq(0, &(buffer.lastEnqueues[0].ptr));
+        __writeq(0, &(buffer.lastEnqueues[1].ptr));
+        buffer.validBit = 1;
+        buffer.lastEnqueuesIndex = 0;
+    }
+
+    // Returns false if the cell is torn or does not refer to a node enqueued to bufferId after removedIndex
+    bool getPotentialTail(const LastEnqueue& lastEnqueue, int bufferId, uint64_t removedIndex, LastEnqueue& potentialTail) {
+        if (getBit(lastEnqueue.index, ValidBitPositionInIndex) != getBit((uint64_t)lastEnqueue.ptr, ValidBitPositionInPointer)) {
+            return false;
+        }
+        potentialTail.index = zeroBit(lastEnqueue.index, ValidBitPositionInIndex);
+        potentialTail.ptr = (PersistentNode*)zeroBit((uint64_t)lastEnqueue.ptr, ValidBitPositionInPointer);
+        return potentialTail.index > removedIndex && potentialTail.ptr &&
+            potentialTail.ptr->index == potentialTail.index &&
+            potentialTail.ptr->owner == queueId && potentialTail.ptr->buffer == (uint32_t)bufferId;
+    }
+
+    bool getBufferNodesIfTail(const LastEnqueue& potentialTail, int bufferId, uint64_t removedIndex,
+        std::vector<PersistentNode*>& bufferNodes) {
+        PersistentNode* currNode = potentialTail.ptr;
+        while (true) {
+            bufferNodes.push_back(currNode);
+            if (currNode->index == removedIndex + 1) {
+                return true;
+            }
+            PersistentNode* predNode = currNode->pred;
+            if (predNode == nullptr || predNode->index != currNode->index - 1 ||
+                predNode->owner != queueId || predNode->buffer != (uint32_t)bufferId) {
+                bufferNodes.clear();
+                return false;
+            }
+            currNode = predNode;
+        }
+    }
+
+    /*
+    Recovery is split into phases, so that QueueRegistry can recover all the queues sharing alloc
+    with a single scan of its chunks:
+    recoverBegin, then isQueueNode or retireNonQueueNode on every node of the chunks, then recoverEnd.
+    */
+    typedef PersistentNode RecoveryNode;
+
+    struct Recovery {
+        uint64_t removedIndices[MAX_THREADS];
+        std::set<PersistentNode*> queueNodes;
+    };
+
+    static uint32_t ownerOf(PersistentNode* node) {
+        return node->owner;
+    }
+
+    static bool nodeCmp(PersistentNode* node1, PersistentNode* node2) {
+        if (node1->buffer != node2->buffer) {
+            return node1->buffer < node2->buffer;
+        }
+        return node1->index < node2->index;
+    }
+
+    void recoverBegin(Recovery& recovery) {
+        for (int i = 0; i < MAX_THREADS; i++) {
+            localData[i].nodeToRetire = nullptr;
+
+            uint64_t removedIndex = buffers[i].removedIndex.load();
+            recovery.removedIndices[i] = removedIndex;
+
+            LastEnqueue potentialTails[2];
+            bool isValid[2];
+            for (int j = 0; j < 2; j++) {
+                isValid[j] = getPotentialTail(buffers[i].lastEnqueues[j], i, removedIndex, potentialTails[j]);
+            }
+            // The later enqueue first
+            int first = (isValid[0] && isValid[1] && potentialTails[1].index > potentialTails[0].index) ? 1 : 0;
+            std::vector<PersistentNode*> bufferNodes;
+            for (int j : {first, first ^ 1}) {
+                if (isValid[j] && getBufferNodesIfTail(potentialTails[j], i, removedIndex, bufferNodes)) {
+                    break;
+                }
+            }
+            recovery.queueNodes.insert(bufferNodes.begin(), bufferNodes.end());
+        }
+    }
+
+    bool isQueueNode(const Recovery& recovery, PersistentNode* node) {
+        return recovery.queueNodes.find(node) != recovery.queueNodes.end();
+    }
+
+    // Returns whether a flush was issued
+    bool retireNonQueueNode(const Recovery& recovery, PersistentNode* node) {
+        if (node->buffer >= MAX_THREADS || node->index > recovery.removedIndices[node->buffer]) {
+            return retireOrphanNode(node);
+        }
+        return false;
+    }
+
+    static bool retireOrphanNode(PersistentNode* node) {
+        if (node->index != 0) {
+            node->index = 0;
+            FLUSH(node);
+            return true;
+        }
+        return false;
+    }
+
+    void recoverEnd(Recovery& recovery, std::vector<PersistentNode*>& queueNodes) {
+        std::sort(queueNodes.begin(), queueNodes.end(), nodeCmp);
+
+        int n = 0;
+        uint64_t maxTimestamp = 0;
+        auto currNode = queueNodes.begin();
+        for (int i = 0; i < MAX_THREADS; i++) {
+            initializeBuffer(i, recovery.removedIndices[i]);
+            for (; currNode != queueNodes.end() && (*currNode)->buffer == (uint32_t)i; currNode++) {
+                PersistentNode* persistentNode = *currNode;
+                VolatileNode* node = allocVolatileNode();
+                node->item = persistentNode->item;
+                node->timestamp = persistentNode->timestamp;
+                node->index = persistentNode->index;
+                node->next.store(nullptr, std::memory_order_relaxed);
+                node->persistentNode = persistentNode;
+                buffers[i].tail->next.store(node, std::memory_order_relaxed);
+                buffers[i].tail = node;
+
+                maxTimestamp = std::max(maxTimestamp, persistentNode->timestamp);
+            }
+            if (buffers[i].tail->index > 0) {
+                n = i + 1;
+            }
+            recoverLastEnqueues(i);
+        }
+        numBuffers.store(n);
+
+        timestampOffset = 0;
+        uint64_t now = newTimestamp();
+        if (now <= maxTimestamp) {
+            timestampOffset = maxTimestamp + 1 - now;
+        }
+
+        SFENCE();
+    }
+
+    void retireNonQueueNodes(Recovery& recovery) {
+        for (auto curr = alloc->mem_chunks; curr != nullptr; curr = curr->next) {
+            PersistentNode* currChunk = static_cast<PersistentNode*>(curr->obj);
+            uint64_t numOfNodes = SSMEM_DEFAULT_MEM_SIZE / sizeof(PersistentNode);
+            for (uint64_t i = 0; i < numOfNodes; i++) {
+                PersistentNode* currNode = currChunk + i;
+                if (!isQueueNode(recovery, currNode)) {
+                    retireNonQueueNode(recovery, currNode);
+                    ssmem_free(alloc, currNode);
+                }
+            }
+        }
+    }
+
+    bool isValidTail(int bufferId, const LastEnqueue& potentialTail) {
+        VolatileNode* tail = buffers[bufferId].tail;
+        return (zeroBit(potentialTail.index, ValidBitPositionInIndex) == tail->index) &&
+            ((PersistentNode*)zeroBit((uint64_t)potentialTail.ptr, ValidBitPositionInPointer) == tail->persistentNode) &&
+            (tail->persistentNode != nullptr) &&
+            (getBit(potentialTail.index, ValidBitPositionInIndex) == getBit((uint64_t)potentialTail.ptr, ValidBitPositionInPointer));
+    }
+
+    // See OptLinkedQ::recoverLastEnqueues
+    void recoverLastEnqueues(int bufferId) {
+        Buffer& buffer = buffers[bufferId];
+        if (!isValidTail(bufferId, buffer.lastEnqueues[0]) && !isValidTail(bufferId, buffer.lastEnqueues[1])) {
+            resetLastEnqueueForBuffer(bufferId);
+        } else if (isValidTail(bufferId, buffer.lastEnqueues[0])) {
+            __writeq(0, &(buffer.lastEnqueues[1].index));
+            __writeq(0, &(buffer.lastEnqueues[1].ptr));
+            buffer.lastEnqueuesIndex = 1;
+            buffer.validBit = getBit(buffer.lastEnqueues[0].index, ValidBitPositionInIndex);
+        } else {
+            __writeq(0, &(buffer.lastEnqueues[0].index));
+            __writeq(0, &(buffer.lastEnqueues[0].ptr));
+            buffer.lastEnqueuesIndex = 0;
+            buffer.validBit = getBit(buffer.lastEnqueues[1].index, ValidBitPositionInIndex) ^ 1;
+        }
+    }
+};
+
+#endif /* TIMESTAMPED_Q_H_ */
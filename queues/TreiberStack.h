@@ -0,0 +1,412 @@
+#pragma once
+
+#ifndef TREIBER_STACK_H_
+#define TREIBER_STACK_H_
+
+#include <atomic>
+#include <set>
+#include <vector>
+#include <algorithm>
+
+#include <ssmem.h>
+
+#include "utilities.h"
+
+#define STACK_ELIMINATION_SLOTS 16  /* slots of the elimination array, must be a power of 2 */
+#define STACK_ELIMINATION_SPINS 128 /* iterations a push waits in a slot, or a pop looks into one */
+
+/*
+A durable Treiber stack, built like OptLinkedQ: the persistent nodes hold an index (their height) and
+a pointer to the node below them, and each thread persists the top its last operation saw or installed,
+in two cells with valid bits, as OptLinkedQ does with its last enqueues.
+Every operation installs a new volatile top with the next version (a pop installs a copy of the node below),
+so recovery restores the recorded top of the highest version and follows the pred pointers from it.
+Optionally, a push and a pop that fail their CAS can eliminate each other through an elimination array.
+*/
+template<class T> class TreiberStack {
+private:
+    class PersistentNode {
+    public:
+        T item;
+        PersistentNode* pred;
+        uint64_t index;
+        uint32_t owner; // The id of the stack the node was allocated for
+    } __attribute__((aligned (32)));
+
+    class VolatileNode {
+    public:
+        T item;
+        uint64_t index;
+        uint64_t version;
+        VolatileNode* next;
+        PersistentNode* persistentNode;
+
+        void copy(VolatileNode* other) {
+            item = other->item;
+            index = other->index;
+            next = other->next;
+            persistentNode = other->persistentNode;
+        }
+    } __attribute__((aligned (32)));
+
+    static const int ValidBitPositionInPointer = 0;
+    static const int ValidBitPositionInVersion = sizeof(uint64_t) * 8 - 1;
+
+    VolatileNode* allocVolatileNode() {
+        void* volatileNode = ssmem_alloc(volatileAlloc, sizeof(VolatileNode));
+        return static_cast<VolatileNode*>(volatileNode);
+    }
+
+    template<class Q> friend class QueueRegistry;
+
+public:
+    // Stacks whose nodes share an allocator must have distinct ids, for telling their nodes apart in recovery
+    TreiberStack(uint32_t id = 1) :
+        Top(allocBottomNode(0)),
+        elimination(false),
+        queueId(id)
+    {
+        for (int i = 0; i < MAX_THREADS; i++) {
+            resetLastTopsForThread(i);
+            localData[i].eliminationSeed = i + 1;
+        }
+        for (int i = 0; i < STACK_ELIMINATION_SLOTS; i++) {
+            eliminationSlots[i].offer.store(nullptr, std::memory_order_relaxed);
+        }
+        SFENCE();
+    }
+
+    void push(T item, int threadId) {
+        VolatileNode* newNode = allocVolatileNode();
+        newNode->item = item;
+        PersistentNode* persistentNode = static_cast<PersistentNode*>(ssmem_alloc(alloc, sizeof(PersistentNode)));
+        newNode->persistentNode = persistentNode;
+        persistentNode->item = item;
+        persistentNode->owner = queueId;
+
+        while (true) {
+            VolatileNode* top = Top.load(ORDER_ACQUIRE);
+            newNode->next = top;
+            newNode->index = top->index + 1;
+            newNode->version = top->version + 1;
+            persistentNode->pred = top->persistentNode;
+            std::atomic_thread_fence(std::memory_order_release); // pred must be written before the index
+            persistentNode->index = newNode->index;
+            // The write-back is ordered by the CAS, so a node is persisted before any thread can see it
+            FLUSH_RANGE(persistentNode, sizeof(PersistentNode));
+            ISSUE_FLUSHES();
+            if (Top.compare_exchange_strong(top, newNode, ORDER_ACQ_REL, ORDER_RELAXED)) {
+                recordLastTop(newNode, threadId);
+                SFENCE();
+                return;
+            }
+            if (elimination && tryEliminatePush(newNode, threadId)) {
+                // The item went straight to a pop, the nodes were never published
+                ssmem_free(alloc, persistentNode);
+                ssmem_free(volatileAlloc, newNode);
+                return;
+            }
+        }
+    }
+
+    bool pop(T* poppedItem, int threadId) {
+        VolatileNode* newTop = allocVolatileNode();
+        while (true) {
+            VolatileNode* top = Top.load(ORDER_ACQUIRE);
+            if (top->index == 0) {
+                // The empty state must be durable before reporting it
+                recordLastTop(top, threadId);
+                SFENCE();
+                ssmem_free(volatileAlloc, newTop);
+                return false;
+            }
+
+            VolatileNode* below = top->next;
+            newTop->copy(below);
+            newTop->version = top->version + 1;
+            if (Top.compare_exchange_strong(top, newTop, ORDER_ACQ_REL, ORDER_RELAXED)) {
+                *poppedItem = top->item;
+                recordLastTop(newTop, threadId);
+                SFENCE();
+
+                // below was replaced by its copy
+                ssmem_free(alloc, top->persistentNode);
+                ssmem_free(volatileAlloc, top);
+                ssmem_free(volatileAlloc, below);
+                return true;
+            }
+            if (elimination && tryEliminatePop(poppedItem, threadId)) {
+                ssmem_free(volatileAlloc, newTop);
+                return true;
+            }
+        }
+    }
+
+    // Let pushes and pops that fail their CAS meet in the elimination array
+    void setElimination(bool enabled) {
+        elimination = enabled;
+    }
+
+    void recover() {
+        Recovery recovery;
+        recoverBegin(recovery);
+
+        retireNonQueueNodes(recovery); // retiring alloc's nodes; volatileAlloc is assumed to be reset
+
+        std::vector<PersistentNode*> queueNodes(recovery.queueNodes.begin(), recovery.queueNodes.end());
+        recoverEnd(recovery, queueNodes);
+    }
+
+private:
+    std::atomic<VolatileNode*> Top DOUBLE_CACHE_LINE_ALIGNED;
+    bool elimination;
+    uint32_t queueId;
+
+    struct LastTop {
+        PersistentNode* ptr;
+        uint64_t version;
+    };
+
+    struct LocalData {
+        int validBit CACHE_LINE_ALIGNED;
+        int lastTopsIndex;
+        uint32_t eliminationSeed;
+        LastTop lastTops[2] CACHE_LINE_ALIGNED;
+    } DOUBLE_CACHE_LINE_ALIGNED;
+
+    LocalData localData[MAX_THREADS];
+
+    struct EliminationSlot {
+        std::atomic<VolatileNode*> offer CACHE_LINE_ALIGNED;
+    } CACHE_LINE_ALIGNED;
+
+    EliminationSlot eliminationSlots[STACK_ELIMINATION_SLOTS]; // Volatile
+
+    // The node below all others, standing for the empty stack
+    VolatileNode* allocBottomNode(uint64_t version) {
+        VolatileNode* bottomNode = allocVolatileNode();
+        bottomNode->index = 0;
+        bottomNode->version = version;
+        bottomNode->next = nullptr;
+        bottomNode->persistentNode = nullptr;
+        return bottomNode;
+    }
+
+    uint32_t randomSlot(int threadId) {
+        uint32_t& seed = localData[threadId].eliminationSeed;
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed & (STACK_ELIMINATION_SLOTS - 1);
+    }
+
+    // Returns true if a pop took the offered node
+    bool tryEliminatePush(VolatileNode* node, int threadId) {
+        std::atomic<VolatileNode*>& offer = eliminationSlots[randomSlot(threadId)].offer;
+        VolatileNode* noOffer = nullptr;
+        if (!offer.compare_exchange_strong(noOffer, node)) {
+            return false;
+        }
+        for (int i = 0; i < STACK_ELIMINATION_SPINS; i++) {
+            if (offer.load() != node) {
+                return true;
+            }
+        }
+        VolatileNode* expected = node;
+        return !offer.compare_exchange_strong(expected, nullptr); // Otherwise the offer is withdrawn
+    }
+
+    // A pair that eliminates each other leaves the stack as it was, so it has nothing to persist
+    bool tryEliminatePop(T* poppedItem, int threadId) {
+        std::atomic<VolatileNode*>& offer = eliminationSlots[randomSlot(threadId)].offer;
+        for (int i = 0; i < STACK_ELIMINATION_SPINS; i++) {
+            VolatileNode* node = offer.load();
+            if (node != nullptr) {
+                T item = node->item; // Read before taking the offer, after which the pusher frees the node
+                if (!offer.compare_exchange_strong(node, nullptr)) {
+                    return false;
+                }
+                *poppedItem = item;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    uint64_t zeroBit(uint64_t value, int bitIndex) {
+        return value & ~(1UL << bitIndex);
+    }
+
+    uint64_t applyBit(uint64_t value, int bitIndex, uint64_t bitValue) {
+        return zeroBit(value, bitIndex) | (bitValue << bitIndex);
+    }
+
+    uint64_t getBit(uint64_t value, int bitIndex) {
+        return (value >> bitIndex) & 1UL;
+    }
+
+    // See OptLinkedQ::recordLastEnqueue
+    void recordLastTop(VolatileNode* top, int threadId) {
+        int i = localData[threadId].lastTopsIndex;
+
+        __writeq((void*)applyBit((uint64_t)top->persistentNode, ValidBitPositionInPointer, localData[threadId].validBit), &(localData[threadId].lastTops[i].ptr));
+        __writeq(applyBit(top->version, ValidBitPositionInVersion, localData[threadId].validBit), &(localData[threadId].lastTops[i].version));
+
+        localData[threadId].validBit ^= i;
+        localData[threadId].lastTopsIndex ^= 1;
+    }
+
+    void resetLastTopsForThread(int threadId) {
+        __writeq(0, &(localData[threadId].lastTops[0].version));
+        __writeq(0, &(localData[threadId].lastTops[1].version));
+        __writeq(0, &(localData[threadId].lastTops[0].ptr));
+        __writeq(0, &(localData[threadId].lastTops[1].ptr));
+        localData[threadId].validBit = 1;
+        localData[threadId].lastTopsIndex = 0;
+    }
+
+    static bool lastTopCmp(const LastTop& lastTop1, const LastTop& lastTop2) {
+        return lastTop1.version > lastTop2.version;
+    }
+
+    void getPotentialTops(std::vector<LastTop>& potentialTops) {
+        for (int i = 0; i < MAX_THREADS; i++) {
+            for (int j = 0; j < 2; j++) {
+                if (getBit(localData[i].lastTops[j].version, ValidBitPositionInVersion) !=
+                    getBit((uint64_t)localData[i].lastTops[j].ptr, ValidBitPositionInPointer)) {
+                    continue;
+                }
+                LastTop potentialTop = localData[i].lastTops[j];
+                potentialTop.version = zeroBit(potentialTop.version, ValidBitPositionInVersion);
+                potentialTop.ptr = (PersistentNode*)zeroBit((uint64_t)potentialTop.ptr, ValidBitPositionInPointer);
+                potentialTops.push_back(potentialTop);
+            }
+        }
+        std::sort(potentialTops.begin(), potentialTops.end(), lastTopCmp); // The latest first
+    }
+
+    bool getQueueNodesIfTop(const LastTop& potentialTop, std::set<PersistentNode*>& queueNodes) {
+        PersistentNode* currNode = potentialTop.ptr;
+        while (currNode != nullptr) {
+            if (currNode->owner != queueId || currNode->index == 0 ||
+                (currNode->pred != nullptr && currNode->pred->index != currNode->index - 1) ||
+                (currNode->pred == nullptr && currNode->index != 1)) {
+                queueNodes.clear();
+                return false;
+            }
+            queueNodes.insert(currNode);
+            currNode = currNode->pred;
+        }
+        return true;
+    }
+
+    /*
+    Recovery is split into phases, so that QueueRegistry can recover all the stacks sharing alloc
+    with a single scan of its chunks:
+    recoverBegin, then isQueueNode or retireNonQueueNode on every node of the chunks, then recoverEnd.
+    */
+    typedef PersistentNode RecoveryNode;
+
+    struct Recovery {
+        uint64_t version;
+        std::set<PersistentNode*> queueNodes;
+    };
+
+    static uint32_t ownerOf(PersistentNode* node) {
+        return node->owner;
+    }
+
+    static bool nodeCmp(PersistentNode* node1, PersistentNode* node2) {
+        return node1->index < node2->index;
+    }
+
+    void recoverBegin(Recovery& recovery) {
+        for (int i = 0; i < STACK_ELIMINATION_SLOTS; i++) {
+            eliminationSlots[i].offer.store(nullptr, std::memory_order_relaxed);
+        }
+
+        std::vector<LastTop> potentialTops;
+        getPotentialTops(potentialTops);
+
+        recovery.version = 0;
+        for (auto& potentialTop : potentialTops) {
+            if (getQueueNodesIfTop(potentialTop, recovery.queueNodes)) {
+                recovery.version = potentialTop.version;
+                break;
+            }
+        }
+    }
+
+    bool isQueueNode(const Recovery& recovery, PersistentNode* node) {
+        return recovery.queueNodes.find(node) != recovery.queueNodes.end();
+    }
+
+    // Returns whether a flush was issued. Nothing to clear: only recorded tops are followed.
+    bool retireNonQueueNode(const Recovery& recovery, PersistentNode* node) {
+        return false;
+    }
+
+    static bool retireOrphanNode(PersistentNode* node) {
+        return false;
+    }
+
+    void recoverEnd(Recovery& recovery, std::vector<PersistentNode*>& queueNodes) {
+        std::sort(queueNodes.begin(), queueNodes.end(), nodeCmp);
+
+        VolatileNode* top = allocBottomNode(recovery.version);
+        for (auto persistentNode : queueNodes) {
+            VolatileNode* node = allocVolatileNode();
+            node->item = persistentNode->item;
+            node->index = persistentNode->index;
+            node->version = recovery.version;
+            node->next = top;
+            node->persistentNode = persistentNode;
+            top = node;
+        }
+        Top.store(top);
+
+        recoverLastTops();
+
+        SFENCE();
+    }
+
+    bool isValidTop(const LastTop& potentialTop) {
+        return (zeroBit(potentialTop.version, ValidBitPositionInVersion) == Top.load()->version) &&
+            ((PersistentNode*)zeroBit((uint64_t)potentialTop.ptr, ValidBitPositionInPointer) == Top.load()->persistentNode) &&
+            (getBit(potentialTop.version, ValidBitPositionInVersion) == getBit((uint64_t)potentialTop.ptr, ValidBitPositionInPointer));
+    }
+
+    // Keep the cells that refer to the recovered top, as in OptLinkedQ::recoverLastEnqueues
+    void recoverLastTops() {
+        for (int i = 0; i < MAX_THREADS; i++) {
+            if (!isValidTop(localData[i].lastTops[0]) && !isValidTop(localData[i].lastTops[1])) {
+                resetLastTopsForThread(i);
+            } else if (isValidTop(localData[i].lastTops[0])) {
+                __writeq(0, &(localData[i].lastTops[1].version));
+                __writeq(0, &(localData[i].lastTops[1].ptr));
+                localData[i].lastTopsIndex = 1;
+                localData[i].validBit = getBit(localData[i].lastTops[0].version, ValidBitPositionInVersion);
+            } else {
+                __writeq(0, &(localData[i].lastTops[0].version));
+                __writeq(0, &(localData[i].lastTops[0].ptr));
+                localData[i].lastTopsIndex = 0;
+                localData[i].validBit = getBit(localData[i].lastTops[1].version, ValidBitPositionInVersion) ^ 1;
+            }
+        }
+    }
+
+    void retireNonQueueNodes(Recovery& recovery) {
+        for (auto curr = alloc->mem_chunks; curr != nullptr; curr = curr->next) {
+            PersistentNode* currChunk = static_cast<PersistentNode*>(curr->obj);
+            uint64_t numOfNodes = SSMEM_DEFAULT_MEM_SIZE / sizeof(PersistentNode);
+            for (uint64_t i = 0; i < numOfNodes; i++) {
+                PersistentNode* currNode = currChunk + i;
+                if (!isQueueNode(recovery, currNode)) {
+                    ssmem_free(alloc, currNode);
+                }
+            }
+        }
+    }
+};
+
+#endif /* TREIBER_STACK_H_ */
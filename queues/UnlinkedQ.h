@@ -4,10 +4,14 @@
 #define UNLINKED_Q_H_
 
 #include <atomic>
-#include <set>
+#include <vector>
+#include <algorithm>
 #include <assert.h>
 
 #include <ssmem.h>
+#include <flusher.h>
+#include <capacity.h>
+#include <purge.h>
 
 #include "utilities.h"
 
@@ -17,13 +21,13 @@ private:
     public:
         T item;
         std::atomic<Node*> next;
-        bool linked;
+        uint32_t linked; // The id of the queue the node is linked into, 0 until it is linked
         uint64_t index;
 
         void initialize(T value) {
             item = value;
-            next = nullptr;
-            linked = false;
+            next.store(nullptr, ORDER_RELAXED);
+            linked = 0;
 
             // verify linked is set to false before index is later increased
             std::atomic_thread_fence(std::memory_order_release);
@@ -57,10 +61,15 @@ private:
         assert(std::atomic<PointerAndIndex>().is_lock_free());
     }
 
+    template<class Q> friend class QueueRegistry;
+
 public:
-    UnlinkedQ() :
+    // Queues whose nodes share an allocator must have distinct ids, for telling their nodes apart in recovery
+    UnlinkedQ(uint32_t id = 1) :
         Head(PointerAndIndex(allocNode(), 0)),
-        Tail(Head.load().ptr)
+        Tail(Head.load().ptr),
+        flusher(nullptr),
+        queueId(id)
     {
         Node* head = Head.load().ptr;
         head->initialize();
@@ -72,16 +81,20 @@ public:
     }
 
     bool deq(T* dequeuedItem, int threadId) {
+        if (!purgedNodes[threadId].isEmpty()) {
+            reclaimPurged(threadId, PURGE_RECLAIM_BATCH);
+        }
+
         while (true) {
-            PointerAndIndex head = Head.load();
-            Node* headNext = head.ptr->next.load();
+            PointerAndIndex head = Head.load(ORDER_ACQUIRE);
+            Node* headNext = head.ptr->next.load(ORDER_ACQUIRE);
             if (headNext == nullptr) {
                 FLUSH(&Head);
                 SFENCE();
                 return false;
             }
             
-            if (Head.compare_exchange_strong(head, PointerAndIndex(headNext, headNext->index))) {
+            if (Head.compare_exchange_strong(head, PointerAndIndex(headNext, headNext->index), ORDER_ACQ_REL, ORDER_RELAXED)) {
                 *dequeuedItem = headNext->item;
                 FLUSH(&Head);
                 SFENCE();
@@ -90,6 +103,8 @@ public:
                     ssmem_free(alloc, nodeToRetire[threadId].ptr);
                 }
                 nodeToRetire[threadId].ptr = head.ptr;
+
+                capacity.notifyDequeue();
                 
                 return true;
             }
@@ -97,81 +112,214 @@ public:
     }
 
     void enq(T item, int threadId) {
+        if (!purgedNodes[threadId].isEmpty()) {
+            reclaimPurged(threadId, PURGE_RECLAIM_BATCH);
+        }
+
         Node* newNode = allocNode();
         newNode->initialize(item);
 
         while (true) {
-            Node* tail = Tail.load();
-            Node* tailNext = tail->next.load();
+            Node* tail = Tail.load(ORDER_ACQUIRE);
+            Node* tailNext = tail->next.load(ORDER_ACQUIRE);
             if (tailNext == nullptr) {
                 newNode->index = tail->index + 1;
-                if (tail->next.compare_exchange_strong(tailNext, newNode)) {
-                    newNode->linked = true;
-                    FLUSH(newNode);
-                    Tail.compare_exchange_strong(tail, newNode);
+                if (tail->next.compare_exchange_strong(tailNext, newNode, ORDER_RELEASE, ORDER_RELAXED)) {
+                    newNode->linked = queueId;
+                    if (flusher) {
+                        flusher->publish(newNode, threadId);
+                    } else {
+                        FLUSH(newNode);
+                        ISSUE_FLUSHES();
+                    }
+                    Tail.compare_exchange_strong(tail, newNode, ORDER_RELEASE, ORDER_RELAXED);
                     break;
                 }
             }
-            Tail.compare_exchange_strong(tail, tailNext);
+            Tail.compare_exchange_strong(tail, tailNext, ORDER_RELEASE, ORDER_RELAXED);
+        }
+    }
+
+    // Remove the items up to index at once (all of them, if the queue holds no item of that index),
+    // persisting the new head index only once. Returns the head index after the purge.
+    // The removed nodes are freed lazily, by threadId's later operations or by reclaimPurged.
+    uint64_t purgeUntil(uint64_t index, int threadId) {
+        Node* target = Head.load(ORDER_ACQUIRE).ptr;
+        while (true) {
+            PointerAndIndex head = Head.load(ORDER_ACQUIRE);
+            if (target->index <= head.index) {
+                target = head.ptr; // Dequeuers passed it
+            }
+            while (target->index < index) {
+                Node* targetNext = target->next.load(ORDER_ACQUIRE);
+                if (targetNext == nullptr) {
+                    break;
+                }
+                target = targetNext;
+            }
+            if (target == head.ptr) {
+                return head.index;
+            }
+
+            if (Head.compare_exchange_strong(head, PointerAndIndex(target, target->index), ORDER_ACQ_REL, ORDER_RELAXED)) {
+                FLUSH(&Head);
+                SFENCE();
+
+                purgedNodes[threadId].add(head.ptr, target);
+                capacity.notifyDequeue();
+                return target->index;
+            }
+        }
+    }
+
+    // Free up to maxNodes of the nodes threadId purged, e.g. all of them while the thread is idle
+    void reclaimPurged(int threadId, uint64_t maxNodes = UINT64_MAX) {
+        purgedNodes[threadId].reclaim(maxNodes, [](Node* node) {
+            ssmem_free(alloc, node);
+        });
+    }
+
+    // Delegate the write-back of enqueued nodes to a flusher thread; nullptr restores in-line flushing
+    void setFlusher(Flusher* f) {
+        flusher = f;
+    }
+
+    // Wait until the nodes enqueued so far are persisted (without a flusher, the ones the calling thread enqueued)
+    void sync() {
+        if (flusher) {
+            flusher->waitPersisted(flusher->ticket());
+        } else {
+            SFENCE();
+        }
+    }
+
+    // Bound the queue to maxItems items and to maxNodeBytes bytes of nodes (0 for unbounded).
+    // The bounds apply to tryEnq and enqWait only.
+    void setCapacity(uint64_t maxItems, size_t maxNodeBytes = 0) {
+        capacity.set(maxItems, maxNodeBytes);
+    }
+
+    // Returns false, without enqueuing, if the queue is at its capacity
+    bool tryEnq(T item, int threadId) {
+        if (!capacity.hasRoom(getSize(), sizeof(Node))) {
+            return false;
         }
+        enq(item, threadId);
+        return true;
+    }
+
+    // Waits for a dequeue to make room if the queue is at its capacity
+    void enqWait(T item, int threadId) {
+        capacity.waitForRoom([&] { return capacity.hasRoom(getSize(), sizeof(Node)); });
+        enq(item, threadId);
     }
 
     void recover() {
-        initializeNodeToRetire();
+        Recovery recovery;
+        recoverBegin(recovery);
 
-        std::set<Node*, decltype(nodeCmp)*> queueNodes(nodeCmp); // Not including the new dummy node we will later allocate
-        getQueueNodesAndRetireOthers(queueNodes);
+        std::vector<Node*> queueNodes; // Not including the new dummy node we will later allocate
+        getQueueNodesAndRetireOthers(recovery, queueNodes);
 
         // We allocate a new dummy node only after retiring non-queue nodes, for preventing retiring the dummy node
-        recoverHead();
-
-        recoverLinksAndTail(queueNodes);
+        recoverEnd(recovery, queueNodes);
     }
 
 private:
     std::atomic<PointerAndIndex> Head DOUBLE_CACHE_LINE_ALIGNED;
     std::atomic<Node*> Tail DOUBLE_CACHE_LINE_ALIGNED;
+    Flusher* flusher;
+    uint32_t queueId;
+    Capacity capacity;
     
     struct NodePtr {
         Node* ptr;
     } DOUBLE_CACHE_LINE_ALIGNED;
 
     NodePtr nodeToRetire[MAX_THREADS];
+    PurgedNodes<Node> purgedNodes[MAX_THREADS]; // Volatile
 
     void initializeNodeToRetire() {
         for (int i = 0; i < MAX_THREADS; i++) {
             nodeToRetire[i].ptr = nullptr;
+            purgedNodes[i].clear();
         }
     }
 
+    uint64_t getSize() {
+        return Tail.load(ORDER_ACQUIRE)->index - Head.load(ORDER_ACQUIRE).index;
+    }
+
     static bool nodeCmp(Node* node1, Node* node2) { 
         return node1->index < node2->index; 
     }
 
-    void getQueueNodesAndRetireOthers(std::set<Node*, decltype(nodeCmp)*>& queueNodes) {
+    /*
+    Recovery is split into phases, so that QueueRegistry can recover all the queues sharing alloc
+    with a single scan of its chunks:
+    recoverBegin, then isQueueNode or retireNonQueueNode on every node of the chunks, then recoverEnd.
+    */
+    typedef Node RecoveryNode;
+
+    struct Recovery {
+        uint64_t headIndex;
+    };
+
+    static uint32_t ownerOf(Node* node) {
+        return node->linked;
+    }
+
+    void recoverBegin(Recovery& recovery) {
+        flusher = nullptr; // a flusher does not survive a crash
+        initializeNodeToRetire();
+        recovery.headIndex = Head.load().index;
+    }
+
+    bool isQueueNode(const Recovery& recovery, Node* node) {
+        return node->linked == queueId && node->index > recovery.headIndex;
+    }
+
+    // Returns whether a flush was issued. Nothing to clear: initialize() resets linked before a node is reused.
+    bool retireNonQueueNode(const Recovery& recovery, Node* node) {
+        return false;
+    }
+
+    static bool retireOrphanNode(Node* node) {
+        return false;
+    }
+
+    void recoverEnd(Recovery& recovery, std::vector<Node*>& queueNodes) {
+        std::sort(queueNodes.begin(), queueNodes.end(), nodeCmp);
+
+        recoverHead(recovery.headIndex);
+
+        recoverLinksAndTail(queueNodes);
+    }
+
+    void getQueueNodesAndRetireOthers(Recovery& recovery, std::vector<Node*>& queueNodes) {
         for (auto curr = alloc->mem_chunks; curr != nullptr; curr = curr->next) {
             Node* currChunk = static_cast<Node*>(curr->obj);
             uint64_t numOfNodes = SSMEM_DEFAULT_MEM_SIZE / sizeof(Node);
             for (uint64_t i = 0; i < numOfNodes; i++) {
                 Node* currNode = currChunk + i;
-                if (currNode->linked && currNode->index > Head.load().index) {
-                    queueNodes.insert(currNode);
+                if (isQueueNode(recovery, currNode)) {
+                    queueNodes.push_back(currNode);
                 }
                 else {
+                    retireNonQueueNode(recovery, currNode);
                     ssmem_free(alloc, currNode);
                 }
             }
         }
     }
 
-    void recoverHead() {
-        uint64_t headIndex = Head.load().index;
+    void recoverHead(uint64_t headIndex) {
         Node* head = allocNode();
         head->index = headIndex;
         Head.store(PointerAndIndex(head, headIndex));
     }
 
-    void recoverLinksAndTail(std::set<Node*, decltype(nodeCmp)*>& queueNodes) {
+    void recoverLinksAndTail(const std::vector<Node*>& queueNodes) {
         Node* predNode = Head.load().ptr;
         for (auto node : queueNodes) {
             predNode->next.store(node);